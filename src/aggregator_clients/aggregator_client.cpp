@@ -1,53 +1,105 @@
+#include "config/config.hpp"
 #include "logging/logging.hpp"
 #include "aggregator_clients/aggregator_client.hpp"
 #include "aggregator_clients/client_manager.hpp"
+#include "aggregator_clients/cache_snapshot.hpp"
 #include "verboze_api/verboze_api.hpp"
 
-/**
- * Adds JSON data into an existing JSON dictionary recursing on OBJECT types
- * @param  base     The base JSON object that will be modified (type must be OBJECT)
- * @param  new_data The data to merge into base (type must be OBJECT)
- * @return          true if anything changed, false otherwise
- */
-bool __merge_json(json* base, json new_data) {
-    bool is_changed = false;
-    if (new_data.is_object()) {
-        for (json::iterator it = new_data.begin(); it != new_data.end(); it++) {
-            std::string key = it.key();
-            json val = it.value();
-
-            auto existing_entry = base->find(key);
-            bool replace_entry = false;
-            if (existing_entry != base->end()) {
-                json* sub_base = &existing_entry.value();
-                if (sub_base->is_object() && val.is_object())
-                    is_changed = is_changed || __merge_json(sub_base, val);
-                else// if (val != *sub_base) <-- this is wrong sometimes!!
-                    replace_entry = true;
-            } else
-                replace_entry = true;
-
-            if (replace_entry) {
-                (*base)[key] = val;
-                is_changed = true;
-            }
+#include <algorithm>
+
+/*******************************************************************************************
+ * PUBLISHED CACHE
+ *******************************************************************************************/
+
+const std::string& AggregatorClient::PUBLISHED_CACHE::GetBlueprint() const {
+    std::call_once(m_blueprint_flag, [this]() {
+        size_t size = 2;
+        for (auto it = things.begin(); it != things.end(); it++)
+            size += (*it)->key.size() + (*it)->state.size() + 2;
+        m_blueprint.reserve(size);
+        m_blueprint += '{';
+        for (auto it = things.begin(); it != things.end(); it++) {
+            if (m_blueprint.size() > 1)
+                m_blueprint += ',';
+            m_blueprint += (*it)->key;
+            m_blueprint += ':';
+            m_blueprint += (*it)->state;
         }
+        m_blueprint += '}';
+    });
+    return m_blueprint;
+}
+
+const AggregatorClient::PUBLISHED_THING* AggregatorClient::PUBLISHED_CACHE::FindThing(const std::string& thing_id) const {
+    auto it = std::lower_bound(things.begin(), things.end(), thing_id, [](const std::shared_ptr<const PUBLISHED_THING>& thing, const std::string& id) { return thing->id < id; });
+    return it != things.end() && (*it)->id == thing_id ? it->get() : nullptr;
+}
+
+std::string AggregatorClient::PUBLISHED_CACHE::Serialize(const std::string& fields, const std::string& key) const {
+    std::string version_field = ",\"__version\":" + std::to_string(version);
+    if (key == "")
+        return StateStore::SpliceFields(GetBlueprint(), fields + version_field);
+    const PUBLISHED_THING* thing = FindThing(key);
+    return thing ? StateStore::SpliceFields(thing->state, fields + version_field) : "";
+}
+
+std::string AggregatorClient::PUBLISHED_CACHE::SerializeChangesSince(const std::string& fields, uint64_t since) const {
+    // a version above the current one was not issued by this cache (e.g. before the clock went
+    // back across a restart without a snapshot), nothing tells which things changed since
+    if (since > version)
+        since = 0;
+    std::string changes = "{";
+    for (auto it = things.begin(); it != things.end(); it++) {
+        if ((*it)->version <= since)
+            continue;
+        if (changes.size() > 1)
+            changes += ',';
+        changes += (*it)->key;
+        changes += ':';
+        changes += (*it)->state;
     }
-    return is_changed;
+    changes += '}';
+    return StateStore::SpliceFields(changes, fields + ",\"__version\":" + std::to_string(version));
 }
 
-AggregatorClient::AggregatorClient(int fd, DISCOVERED_DEVICE device) : SocketClient(fd, device), m_discovery_info(device) {
+/*******************************************************************************************
+ * CLIENT
+ *******************************************************************************************/
+
+AggregatorClient::AggregatorClient(int fd, DISCOVERED_DEVICE device) : SocketClient(fd, device), m_discovery_info(device), m_is_negotiating_codec(false) {
+    std::shared_ptr<PUBLISHED_CACHE> cache = std::make_shared<PUBLISHED_CACHE>();
+    cache->version = m_cache.GetVersion();
+    m_published_cache = std::move(cache);
 }
 
-void AggregatorClient::Write(json msg) {
+void AggregatorClient::Write(const json& msg) {
     SocketClient::Write(msg); // actually writes to the buffer
 
     /** Perform caching (REMOVED) */
-    //__merge_json(&m_cache, msg);
+    //m_cache.Merge(msg);
 }
 
-bool AggregatorClient::OnMessage(json msg) {
-    SocketClient::OnMessage(msg);
+bool AggregatorClient::OnMessage(json&& msg) {
+    // msg is still read below, so it is logged here rather than handed to SocketClient::OnMessage()
+    if (msg.size() > 0)
+        LOG(trace) << "Received message from " << m_ip << ": " << msg;
+
+    // the reply to the codecs offered in the authentication comes first (middlewares that do
+    // not support them just go on), later messages with a "codec" key are regular messages
+    auto codec_it = msg.find("codec");
+    if (m_is_negotiating_codec.exchange(false) && codec_it != msg.end()) {
+        // the middleware detects the codec of every frame so it is fine to switch while
+        // messages are in flight
+        std::vector<std::string> offered_codecs = ConfigManager::get<std::vector<std::string>>("middleware-codecs");
+        MESSAGE_CODEC codec;
+        if (codec_it.value().is_string() && __codec_from_name(codec_it.value(), &codec) == 0 &&
+            std::find(offered_codecs.begin(), offered_codecs.end(), __codec_name(codec)) != offered_codecs.end()) {
+            LOG(info) << "Client " << m_identifier << " uses the " << __codec_name(codec) << " codec";
+            SetCodec(codec);
+        } else
+            LOG(warning) << "Client " << m_identifier << " picked a codec that was not offered " << codec_it.value();
+        return true;
+    }
 
     if (msg.find("noauth") != msg.end()) {
         LOG(warning) << "Middleware rejected client " << m_identifier << " for no authentication";
@@ -56,15 +108,16 @@ bool AggregatorClient::OnMessage(json msg) {
     }
 
     if (msg.find("code") != msg.end()) {
-        ClientManager::OnControlCommandFromAggregatorClient(this, msg);
+        ClientManager::OnControlCommandFromAggregatorClient(this, std::move(msg));
         return true;
     }
 
     if (msg.find("thing") != msg.end()) // don't react to thing controls messages (should never happen...)
         return true;
 
-    /** Perform caching */
-    bool changed_state = __merge_json(&m_cache, msg);
+    /** Perform caching (only what actually changed is forwarded) */
+    json delta;
+    bool changed_state = m_cache.Merge(msg, &delta);
 
     std::string old_room_id = m_room_id;
     if (msg.find("config") != msg.end()) {
@@ -87,28 +140,97 @@ bool AggregatorClient::OnMessage(json msg) {
             m_discovery_info.type,
             m_discovery_info.data
         );
+        // readers see the new room id with the whole cache, and the blueprint confirms (replaces)
+        // the state of the room loaded from the snapshot
+        __snapshotCache(*__publishCache(nullptr), nullptr);
+        // commands for the room are routed here from now on (once its cache is published)
+        SocketCluster::SetClientRoom(this, m_room_id);
+        ClientManager::OnRoomOnline(this);
+    } else if (changed_state) {
+        std::shared_ptr<const PUBLISHED_CACHE> cache = __publishCache(&delta);
+        if (m_room_id != "")
+            __snapshotCache(*cache, &delta);
     }
 
     if (changed_state) {
-        /** Put the __room_names stamp on the message */
-        msg["__room_id"] = m_room_id;
-        VerbozeAPI::SendCommand(msg);
+        /** Put the __room_names stamp on the delta */
+        delta["__room_id"] = m_room_id;
+        delta["__version"] = m_cache.GetVersion();
+        VerbozeAPI::SendCommand(delta);
     }
 
     return true;
 }
 
-json AggregatorClient::GetCache(std::string key) const {
-    if (key == "")
-        return m_cache;
+std::shared_ptr<const AggregatorClient::PUBLISHED_CACHE> AggregatorClient::__publishCache(const json* things) {
+    std::shared_ptr<PUBLISHED_CACHE> cache = std::make_shared<PUBLISHED_CACHE>();
+    cache->room_id = m_room_id;
+    cache->version = m_cache.GetVersion();
+
+    if (things) {
+        // only the changed things are serialized again, the others are shared
+        cache->things = GetPublishedCache()->things;
+        for (auto it = things->begin(); it != things->end(); it++)
+            __publishThing(*cache, it.key());
+    } else {
+        std::vector<std::string> thing_ids = m_cache.GetThingIds();
+        for (auto id = thing_ids.begin(); id != thing_ids.end(); id++)
+            __publishThing(*cache, *id);
+    }
+
+    std::atomic_store(&m_published_cache, std::shared_ptr<const PUBLISHED_CACHE>(cache));
+    return cache;
+}
+
+void AggregatorClient::__publishThing(PUBLISHED_CACHE& cache, const std::string& thing_id) {
+    std::shared_ptr<PUBLISHED_THING> thing = std::make_shared<PUBLISHED_THING>();
+    if (!m_cache.DumpThing(thing_id, &thing->state, &thing->version))
+        return;
+    thing->id = thing_id;
+    thing->key = json(thing_id).dump();
+
+    auto it = std::lower_bound(cache.things.begin(), cache.things.end(), thing_id, [](const std::shared_ptr<const PUBLISHED_THING>& thing, const std::string& id) { return thing->id < id; });
+    if (it != cache.things.end() && (*it)->id == thing_id)
+        *it = std::move(thing);
+    else
+        cache.things.insert(it, std::move(thing));
+}
+
+void AggregatorClient::__snapshotCache(const PUBLISHED_CACHE& cache, const json* things) {
+    if (!CacheSnapshot::IsEnabled())
+        return;
+
+    if (!things)
+        CacheSnapshot::StoreRoom(cache.room_id, cache.GetBlueprint(), cache.version);
     else {
-        auto it = m_cache.find(key);
-        if (it != m_cache.end())
-            return it.value();
-        return json();
+        for (auto it = things->begin(); it != things->end(); it++) {
+            const PUBLISHED_THING* thing = cache.FindThing(it.key());
+            if (thing)
+                CacheSnapshot::StoreThing(cache.room_id, thing->id, thing->state, thing->version);
+        }
     }
 }
 
+std::shared_ptr<const AggregatorClient::PUBLISHED_CACHE> AggregatorClient::GetPublishedCache() const {
+    return std::atomic_load(&m_published_cache);
+}
+
+json AggregatorClient::GetCache(std::string key) const {
+    std::shared_ptr<const PUBLISHED_CACHE> cache = GetPublishedCache();
+    if (key == "")
+        return json::parse(cache->GetBlueprint());
+    const PUBLISHED_THING* thing = cache->FindThing(key);
+    return thing ? json::parse(thing->state) : json();
+}
+
+std::string AggregatorClient::GetSerializedCache(const std::string& fields, const std::string& key) const {
+    return GetPublishedCache()->Serialize(fields, key);
+}
+
+std::string AggregatorClient::GetSerializedChanges(const std::string& fields, uint64_t version) const {
+    return GetPublishedCache()->SerializeChangesSince(fields, version);
+}
+
 std::string AggregatorClient::GetID() const {
-    return m_room_id;
+    return GetPublishedCache()->room_id;
 }
@@ -2,9 +2,13 @@
 
 #include "socket_cluster/socket_cluster.hpp"
 #include "aggregator_clients/discovery_protocol.hpp"
+#include "aggregator_clients/state_store.hpp"
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
 
 #include <json.hpp>
 using json = nlohmann::json;
@@ -19,15 +23,109 @@ class AggregatorClient : public SocketClient {
     friend class SocketClient;
     friend class ClientManager;
 
-    /** Cache of the state of the client */
-    json m_cache;
+public:
+    /**
+     * The state of a thing in a PUBLISHED_CACHE
+     */
+    struct PUBLISHED_THING {
+        /** thing id */
+        std::string id;
+        /** thing id serialized as a JSON string (its key in the blueprint) */
+        std::string key;
+        /** serialized state */
+        std::string state;
+        /** version of the cache when the thing last changed */
+        uint64_t version;
+    };
+
+    /**
+     * An immutable snapshot of the cache of a client, published by the reactor thread after every
+     * change and read without locking from any thread (also holds the caches of the rooms loaded
+     * from the CacheSnapshot)
+     */
+    struct PUBLISHED_CACHE {
+        /** room id */
+        std::string room_id;
+        /** version of the cache */
+        uint64_t version;
+        /** things, sorted by id (the unchanged ones are shared with the previous snapshot) */
+        std::vector<std::shared_ptr<const PUBLISHED_THING>> things;
+
+        PUBLISHED_CACHE() : version(0) {}
+
+        /**
+         * @return the serialized blueprint (built by the first caller)
+         */
+        const std::string& GetBlueprint() const;
+
+        /**
+         * @param thing_id  Thing id
+         * @return the thing (nullptr if there is none)
+         */
+        const PUBLISHED_THING* FindThing(const std::string& thing_id) const;
 
-    /** Client room id */
+        /**
+         * @param fields  Serialized members to add to the object, each preceded by a comma
+         * @param key     Thing to serialize (the whole blueprint if empty)
+         * @return the blueprint (or the thing) serialized with the fields and the version (__version)
+         *         added to it, empty if there is no such thing (or it is not an object)
+         */
+        std::string Serialize(const std::string& fields, const std::string& key = "") const;
+
+        /**
+         * @param fields  Serialized members to add to the object, each preceded by a comma
+         * @param since   Version of the cache
+         * @return the things changed since that version serialized as a JSON object, with the fields
+         *         and the current version (__version) added to it
+         */
+        std::string SerializeChangesSince(const std::string& fields, uint64_t since) const;
+
+    private:
+        /** guards the construction of m_blueprint */
+        mutable std::once_flag m_blueprint_flag;
+        /** serialized blueprint */
+        mutable std::string m_blueprint;
+    };
+
+private:
+    /** Cache of the state of the client (its blueprint), only used by the reactor thread (the
+     *  serialized states are kept by m_published_cache) */
+    StateStore m_cache;
+
+    /** Client room id (reactor thread only, others use m_published_cache) */
     std::string m_room_id;
 
+    /** Latest snapshot of m_cache and m_room_id (atomic access only) */
+    std::shared_ptr<const PUBLISHED_CACHE> m_published_cache;
+
     /** Discovery info */
     DISCOVERED_DEVICE m_discovery_info;
 
+    /** Whether the codecs were offered in the authentication and the middleware did not reply yet
+     *  (its first message is the only one that can pick a codec) */
+    std::atomic<bool> m_is_negotiating_codec;
+
+    /**
+     * Publishes a new m_published_cache
+     * @param things  Object of the changed things (all the things if nullptr)
+     * @return the new snapshot
+     */
+    std::shared_ptr<const PUBLISHED_CACHE> __publishCache(const json* things);
+
+    /**
+     * Serializes the state of a thing into a snapshot being built (replacing its previous state)
+     * @param cache     Snapshot that is not published yet
+     * @param thing_id  Thing id
+     */
+    void __publishThing(PUBLISHED_CACHE& cache, const std::string& thing_id);
+
+    /**
+     * Records the state of the room in the cache snapshot
+     * @param cache   Snapshot of the room cache
+     * @param things  Object of the things to record (the whole blueprint if nullptr)
+     */
+    void __snapshotCache(const PUBLISHED_CACHE& cache, const json* things);
+
 protected:
     AggregatorClient(int fd, DISCOVERED_DEVICE device);
 
@@ -36,21 +134,46 @@ public:
     /**
      * Extend the SocketClient Write function to make it cache messages
      */
-    virtual void Write(json msg);
+    virtual void Write(const json& msg);
 
     /**
      * Extend the SocketClient OnMessage function to make it cache messages
      */
-    virtual bool OnMessage(json msg);
+    virtual bool OnMessage(json&& msg);
+
+    /**
+     * (THREAD SAFE) Retrieves the current snapshot of the cache of this client
+     * @return the snapshot, which stays valid (and unchanged) as long as it is held
+     */
+    std::shared_ptr<const PUBLISHED_CACHE> GetPublishedCache() const;
 
     /**
-     * Retrieves the cache of this client
+     * (THREAD SAFE) Retrieves the cache of this client
      * @return Cache of the client
      */
     json GetCache(std::string key = "") const;
 
     /**
-     * Retrieves the room ID of this client
+     * (THREAD SAFE) Retrieves the cache of this client serialized, with extra fields and its version
+     * (__version) added to it (only the things that changed are serialized again)
+     * @param fields  Serialized members to add to the object, each preceded by a comma
+     *                (e.g. ,"__room_id":"R-1")
+     * @param key     Thing to retrieve (the whole blueprint if empty)
+     * @return the serialized JSON object, empty if there is no such thing (or it is not an object)
+     */
+    std::string GetSerializedCache(const std::string& fields, const std::string& key = "") const;
+
+    /**
+     * (THREAD SAFE) Retrieves the things of the cache of this client that changed since a version, serialized
+     * with extra fields and the current version (__version) added to them
+     * @param fields   Serialized members to add to the object, each preceded by a comma
+     * @param version  Version of the cache (__version of a previous message of this client)
+     * @return the serialized JSON object
+     */
+    std::string GetSerializedChanges(const std::string& fields, uint64_t version) const;
+
+    /**
+     * (THREAD SAFE) Retrieves the room ID of this client
      * @return m_room_id
      */
     std::string GetID() const;
@@ -0,0 +1,413 @@
+#include "config/config.hpp"
+#include "logging/logging.hpp"
+#include "aggregator_clients/cache_snapshot.hpp"
+#include "utilities/time_utilities.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+std::string CacheSnapshot::m_filename;
+std::atomic<bool> CacheSnapshot::m_is_enabled(false);
+bool CacheSnapshot::m_is_alive = true;
+std::thread CacheSnapshot::m_snapshot_thread;
+std::mutex CacheSnapshot::m_mutex;
+int CacheSnapshot::m_fd = -1;
+uint8_t* CacheSnapshot::m_data = nullptr;
+size_t CacheSnapshot::m_capacity = 0;
+size_t CacheSnapshot::m_size = 0;
+std::deque<std::string> CacheSnapshot::m_overflow;
+size_t CacheSnapshot::m_overflow_size = 0;
+bool CacheSnapshot::m_is_compaction_requested = false;
+std::unordered_map<std::string, std::shared_ptr<const AggregatorClient::PUBLISHED_CACHE>> CacheSnapshot::m_stale_rooms;
+
+uint8_t* CacheSnapshot::__map(int fd, size_t capacity) {
+    void* data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        LOG(error) << "Failed to map the cache snapshot " << m_filename << ": " << strerror(errno);
+        return nullptr;
+    }
+    return (uint8_t*)data;
+}
+
+void CacheSnapshot::__unmap() {
+    if (m_data)
+        munmap(m_data, m_capacity);
+    if (m_fd >= 0)
+        close(m_fd);
+    m_data = nullptr;
+    m_fd = -1;
+    m_capacity = m_size = 0;
+    m_overflow.clear();
+    m_overflow_size = 0;
+    m_is_enabled = false;
+}
+
+void CacheSnapshot::__syncDirectory() {
+    size_t slash = m_filename.rfind('/');
+    std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : m_filename.substr(0, slash));
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0)
+        LOG(warning) << "Failed to flush the directory of the cache snapshot " << m_filename << ": " << strerror(errno);
+    if (fd >= 0)
+        close(fd);
+}
+
+uint32_t CacheSnapshot::__checksum(const RECORD_HEADER& header, const uint8_t* data) {
+    uint32_t hash = 2166136261u;
+    // everything after the checksum (lengths and version)
+    const uint8_t* fields = (const uint8_t*)&header.room_length;
+    for (size_t i = 0; i < sizeof(header) - sizeof(header.checksum); i++)
+        hash = (hash ^ fields[i]) * 16777619u;
+    size_t length = (size_t)header.room_length + header.thing_length + header.state_length;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+size_t CacheSnapshot::__writeRecord(uint8_t* dest, const std::string& room_id, const std::string& thing_id, const std::string& state, uint64_t version) {
+    RECORD_HEADER header;
+    header.room_length = (uint32_t)room_id.size();
+    header.thing_length = (uint32_t)thing_id.size();
+    header.state_length = (uint32_t)state.size();
+    header.version = version;
+    uint8_t* data = dest + sizeof(header);
+    memcpy(data, room_id.data(), room_id.size());
+    memcpy(data + room_id.size(), thing_id.data(), thing_id.size());
+    memcpy(data + room_id.size() + thing_id.size(), state.data(), state.size());
+    header.checksum = __checksum(header, data);
+    memcpy(dest, &header, sizeof(header));
+    return sizeof(header) + room_id.size() + thing_id.size() + state.size();
+}
+
+size_t CacheSnapshot::__replay(const uint8_t* data, size_t size, ROOM_STATES& states) {
+    size_t offset = CACHE_SNAPSHOT_MAGIC_SIZE;
+    while (offset + sizeof(RECORD_HEADER) <= size) {
+        RECORD_HEADER header;
+        memcpy(&header, data + offset, sizeof(header));
+        size_t length = (size_t)header.room_length + header.thing_length + header.state_length;
+        if (header.room_length == 0 || length > size - offset - sizeof(header))
+            break; // end of the log (the rest of the file is zeroes)
+        const uint8_t* record = data + offset + sizeof(header);
+        if (__checksum(header, record) != header.checksum)
+            break; // record cut by a crash
+
+        std::string room_id((const char*)record, header.room_length);
+        std::string thing_id((const char*)record + header.room_length, header.thing_length);
+        std::string state((const char*)record + header.room_length + header.thing_length, header.state_length);
+        if (thing_id.size() == 0) {
+            std::map<std::string, std::string> things;
+            if (__splitBlueprint(state, things) == 0) {
+                RECORDED_ROOM& room = states[room_id];
+                room.things.clear();
+                for (auto it = things.begin(); it != things.end(); it++) {
+                    RECORDED_THING& thing = room.things[it->first];
+                    thing.state = std::move(it->second);
+                    thing.version = header.version;
+                }
+                room.version = std::max(room.version, header.version);
+            }
+        } else {
+            RECORDED_ROOM& room = states[room_id];
+            RECORDED_THING& thing = room.things[thing_id];
+            thing.state = std::move(state);
+            thing.version = header.version;
+            room.version = std::max(room.version, header.version);
+        }
+
+        offset += sizeof(header) + length;
+    }
+    return offset;
+}
+
+int CacheSnapshot::__splitBlueprint(const std::string& state, std::map<std::string, std::string>& things) {
+    json blueprint;
+    try {
+        blueprint = json::parse(state);
+    } catch (...) {}
+    if (!blueprint.is_object())
+        return -1;
+    for (auto it = blueprint.begin(); it != blueprint.end(); it++)
+        things[it.key()] = it->dump();
+    return 0;
+}
+
+std::shared_ptr<const AggregatorClient::PUBLISHED_CACHE> CacheSnapshot::__buildStaleRoom(const std::string& room_id, const RECORDED_ROOM& room) {
+    std::shared_ptr<AggregatorClient::PUBLISHED_CACHE> cache = std::make_shared<AggregatorClient::PUBLISHED_CACHE>();
+    cache->room_id = room_id;
+    cache->version = room.version;
+    cache->things.reserve(room.things.size());
+    for (auto it = room.things.begin(); it != room.things.end(); it++) { // sorted by id
+        std::shared_ptr<AggregatorClient::PUBLISHED_THING> thing = std::make_shared<AggregatorClient::PUBLISHED_THING>();
+        thing->id = it->first;
+        thing->key = json(it->first).dump();
+        thing->state = it->second.state;
+        thing->version = it->second.version;
+        cache->things.push_back(std::move(thing));
+    }
+    return cache;
+}
+
+int CacheSnapshot::__compact() {
+    // the records below m_size never change (only appended to) and only this thread remaps, so
+    // they are replayed and rewritten without holding the lock
+    m_mutex.lock();
+    m_is_compaction_requested = false;
+    const uint8_t* data = m_data;
+    size_t size = m_size;
+    size_t capacity = std::max(m_capacity, (size_t)CACHE_SNAPSHOT_MIN_SIZE);
+    m_mutex.unlock();
+    if (!data)
+        return -1;
+
+    ROOM_STATES states;
+    __replay(data, size, states);
+
+    // an empty blueprint record per room (with the version of the room) followed by a record per
+    // thing (with the version of the thing)
+    std::string compacted(CACHE_SNAPSHOT_MAGIC, CACHE_SNAPSHOT_MAGIC_SIZE);
+    for (auto room = states.begin(); room != states.end(); room++) {
+        size_t offset = compacted.size();
+        compacted.resize(offset + sizeof(RECORD_HEADER) + room->first.size() + 2);
+        __writeRecord((uint8_t*)&compacted[offset], room->first, "", "{}", room->second.version);
+        for (auto thing = room->second.things.begin(); thing != room->second.things.end(); thing++) {
+            offset = compacted.size();
+            compacted.resize(offset + sizeof(RECORD_HEADER) + room->first.size() + thing->first.size() + thing->second.state.size());
+            __writeRecord((uint8_t*)&compacted[offset], room->first, thing->first, thing->second.state, thing->second.version);
+        }
+    }
+
+    // keep at least half of the file free (after the records appended in the meantime) so that
+    // compacting stays rare
+    m_mutex.lock();
+    size_t pending = m_size - size + m_overflow_size;
+    m_mutex.unlock();
+    while (compacted.size() + pending > capacity / 2)
+        capacity *= 2;
+
+    std::string tmp_filename = m_filename + ".tmp";
+    int fd = open(tmp_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    bool is_written = fd >= 0 && ftruncate(fd, capacity) == 0;
+    for (size_t written = 0; is_written && written < compacted.size(); ) {
+        ssize_t n = pwrite(fd, compacted.data() + written, compacted.size() - written, written);
+        if (n <= 0)
+            is_written = false;
+        else
+            written += n;
+    }
+    uint8_t* new_data = nullptr;
+    if (!is_written || fsync(fd) != 0 || !(new_data = __map(fd, capacity))) {
+        LOG(error) << "Failed to compact the cache snapshot " << m_filename << ": " << strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        unlink(tmp_filename.c_str());
+        m_mutex.lock();
+        __unmap();
+        m_mutex.unlock();
+        LOG(error) << "The room caches are no longer persisted";
+        return -1;
+    }
+
+    m_mutex.lock();
+    // move the records appended since the replay (they go back to m_overflow if they do not fit)
+    size_t new_size = compacted.size();
+    size_t tail = m_size - size;
+    if (new_size + tail + m_overflow_size <= capacity) {
+        memcpy(new_data + new_size, m_data + size, tail);
+        new_size += tail;
+        for (auto it = m_overflow.begin(); it != m_overflow.end(); it++) {
+            memcpy(new_data + new_size, it->data(), it->size());
+            new_size += it->size();
+        }
+        m_overflow.clear();
+        m_overflow_size = 0;
+    } else {
+        m_overflow.push_front(std::string((const char*)m_data + size, tail));
+        m_overflow_size += tail;
+        m_is_compaction_requested = true;
+    }
+    if (rename(tmp_filename.c_str(), m_filename.c_str()) != 0) {
+        LOG(error) << "Failed to replace the cache snapshot " << m_filename << ": " << strerror(errno);
+        munmap(new_data, capacity);
+        close(fd);
+        unlink(tmp_filename.c_str());
+        __unmap();
+        m_mutex.unlock();
+        LOG(error) << "The room caches are no longer persisted";
+        return -1;
+    }
+    uint8_t* old_data = m_data;
+    size_t old_capacity = m_capacity;
+    int old_fd = m_fd;
+    m_data = new_data;
+    m_capacity = capacity;
+    m_fd = fd;
+    m_size = new_size;
+    m_mutex.unlock();
+
+    munmap(old_data, old_capacity);
+    close(old_fd);
+    __syncDirectory();
+
+    LOG(debug) << "Compacted the cache snapshot to " << new_size << " bytes (" << states.size() << " rooms)";
+    return 0;
+}
+
+void CacheSnapshot::__append(const std::string& room_id, const std::string& thing_id, const std::string& state, uint64_t version) {
+    if (!m_data)
+        return;
+    size_t length = sizeof(RECORD_HEADER) + room_id.size() + thing_id.size() + state.size();
+    if (m_overflow_size == 0 && m_size + length <= m_capacity)
+        m_size += __writeRecord(m_data + m_size, room_id, thing_id, state, version);
+    else {
+        m_overflow.push_back(std::string(length, '\0'));
+        __writeRecord((uint8_t*)&m_overflow.back()[0], room_id, thing_id, state, version);
+        m_overflow_size += length;
+    }
+    if (m_overflow_size > 0 || m_size > m_capacity / 4 * 3)
+        m_is_compaction_requested = true;
+}
+
+void CacheSnapshot::__threadEntry() {
+    milliseconds next_sync = __get_monotonic_time_ms() + milliseconds(CACHE_SNAPSHOT_SYNC_PERIOD);
+    while (m_is_alive) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(CACHE_SNAPSHOT_SLEEP_PERIOD));
+
+        m_mutex.lock();
+        bool is_compaction_requested = m_is_compaction_requested;
+        m_mutex.unlock();
+        if (is_compaction_requested && __compact() != 0)
+            break;
+
+        milliseconds cur_time = __get_monotonic_time_ms();
+        if (cur_time >= next_sync) {
+            next_sync = cur_time + milliseconds(CACHE_SNAPSHOT_SYNC_PERIOD);
+            // the mapping is only replaced by this thread, so it stays valid without the lock
+            m_mutex.lock();
+            uint8_t* data = m_data;
+            size_t size = m_size;
+            m_mutex.unlock();
+            if (data)
+                msync(data, size, MS_SYNC);
+        }
+    }
+}
+
+int CacheSnapshot::Initialize() {
+    m_filename = ConfigManager::get<std::string>("cache-snapshot-file");
+    if (m_filename.size() == 0)
+        return 0;
+
+    int fd = open(m_filename.c_str(), O_RDWR | O_CREAT, 0600);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        LOG(error) << "Failed to open the cache snapshot " << m_filename << ": " << strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size_t capacity = std::max((size_t)file_stat.st_size, (size_t)CACHE_SNAPSHOT_MIN_SIZE);
+    if ((size_t)file_stat.st_size < capacity && ftruncate(fd, capacity) != 0) {
+        LOG(error) << "Failed to resize the cache snapshot " << m_filename << ": " << strerror(errno);
+        close(fd);
+        return -1;
+    }
+    uint8_t* data = __map(fd, capacity);
+    if (!data) {
+        close(fd);
+        return -1;
+    }
+
+    m_mutex.lock();
+    m_fd = fd;
+    m_data = data;
+    m_capacity = capacity;
+
+    ROOM_STATES states;
+    if (memcmp(m_data, CACHE_SNAPSHOT_MAGIC, CACHE_SNAPSHOT_MAGIC_SIZE) == 0)
+        m_size = __replay(m_data, m_capacity, states);
+    else {
+        if (file_stat.st_size > 0)
+            LOG(warning) << m_filename << " is not a cache snapshot, overwriting it";
+        memset(m_data, 0, m_capacity);
+        memcpy(m_data, CACHE_SNAPSHOT_MAGIC, CACHE_SNAPSHOT_MAGIC_SIZE);
+        m_size = CACHE_SNAPSHOT_MAGIC_SIZE;
+    }
+
+    // the stale rooms keep their recorded versions, the stores of the rooms that reconnect start
+    // above all of them
+    uint64_t max_version = 0;
+    for (auto room = states.begin(); room != states.end(); room++) {
+        m_stale_rooms[room->first] = __buildStaleRoom(room->first, room->second);
+        max_version = std::max(max_version, room->second.version);
+    }
+    StateStore::SetMinVersion(max_version);
+    m_is_enabled = true;
+    m_mutex.unlock();
+
+    LOG(info) << "Loaded the cache of " << states.size() << " rooms from " << m_filename << " (" << m_size << " bytes)";
+
+    m_is_alive = true;
+    m_snapshot_thread = std::thread(__threadEntry);
+    return 0;
+}
+
+void CacheSnapshot::Cleanup() {
+    m_is_alive = false;
+    if (m_snapshot_thread.joinable())
+        m_snapshot_thread.join();
+
+    // the records that did not fit in the mapping are only written by a compaction
+    m_mutex.lock();
+    bool has_overflow = m_overflow_size > 0;
+    m_mutex.unlock();
+    if (has_overflow)
+        __compact();
+
+    m_mutex.lock();
+    if (m_data)
+        msync(m_data, m_capacity, MS_SYNC);
+    __unmap();
+    m_stale_rooms.clear();
+    m_mutex.unlock();
+}
+
+bool CacheSnapshot::IsEnabled() {
+    return m_is_enabled;
+}
+
+void CacheSnapshot::StoreRoom(const std::string& room_id, const std::string& blueprint, uint64_t version) {
+    m_mutex.lock();
+    m_stale_rooms.erase(room_id);
+    __append(room_id, "", blueprint, version);
+    m_mutex.unlock();
+}
+
+void CacheSnapshot::StoreThing(const std::string& room_id, const std::string& thing_id, const std::string& state, uint64_t version) {
+    m_mutex.lock();
+    __append(room_id, thing_id, state, version);
+    m_mutex.unlock();
+}
+
+std::string CacheSnapshot::GetSerializedCache(const std::string& room_id, const std::string& fields, const std::string& key) {
+    std::shared_ptr<const AggregatorClient::PUBLISHED_CACHE> cache;
+    m_mutex.lock();
+    auto room = m_stale_rooms.find(room_id);
+    if (room != m_stale_rooms.end())
+        cache = room->second;
+    m_mutex.unlock();
+    return cache ? cache->Serialize(fields, key) : "";
+}
+
+std::string CacheSnapshot::GetSerializedChanges(const std::string& room_id, const std::string& fields, uint64_t version) {
+    std::shared_ptr<const AggregatorClient::PUBLISHED_CACHE> cache;
+    m_mutex.lock();
+    auto room = m_stale_rooms.find(room_id);
+    if (room != m_stale_rooms.end())
+        cache = room->second;
+    m_mutex.unlock();
+    return cache ? cache->SerializeChangesSince(fields, version) : "";
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "aggregator_clients/aggregator_client.hpp"
+
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/** Identifies a snapshot file (and its format) */
+#define CACHE_SNAPSHOT_MAGIC "VZCACHE2"
+/** Size of CACHE_SNAPSHOT_MAGIC at the start of the file */
+#define CACHE_SNAPSHOT_MAGIC_SIZE 8
+/** Minimum size of the snapshot file (it doubles when compacting does not free enough) */
+#define CACHE_SNAPSHOT_MIN_SIZE (1024 * 1024)
+/** Maximum time the snapshot thread sleeps at once (bounds the delay of a requested compaction) */
+#define CACHE_SNAPSHOT_SLEEP_PERIOD 100
+/** Period for writing the mapped snapshot back to the disk (ms) */
+#define CACHE_SNAPSHOT_SYNC_PERIOD 1000
+
+/**
+ * Persists the caches of the rooms in a memory mapped file so that they survive a restart of
+ * the aggregator.
+ *
+ * The file is a log of records, each holding the serialized state of a thing of a room, or the
+ * whole blueprint of a room (replacing what was recorded for it before). Changes are appended
+ * to the mapped file as they are merged (the page cache writes them back, so a crash of the
+ * aggregator loses nothing), which is the only work done by the reactor threads.
+ *
+ * A dedicated thread does everything that touches the disk: it writes the mapping back
+ * periodically, and compacts the file to the last state of every thing once it is three
+ * quarters full. Compacting replays and rewrites the log into a new file without holding the
+ * lock (the records below the size seen at the start never change), then only copies the
+ * records appended in the meantime and swaps the mappings under it. Records appended while the
+ * mapping is full are kept in memory until the next compaction moves them to the new file.
+ *
+ * On startup the log is replayed into stale room caches (published caches, like those of the
+ * connected rooms), used to answer the queries of Verboze about rooms that are not connected
+ * yet. A room stops being stale once its live connection sends its blueprint, which replaces
+ * the recorded one.
+ *
+ * Every record holds the version of the room cache it was taken from, so the stale rooms keep
+ * the versions Verboze received, and the caches of the rooms that reconnect after a restart
+ * start above all of them (see StateStore::SetMinVersion()) whatever the wall clock says.
+ */
+class CacheSnapshot {
+    /**
+     * Header of a record (followed by the room id, the thing id and the state)
+     */
+    struct RECORD_HEADER {
+        /** FNV-1a of the lengths and the data of the record (detects a record cut by a crash) */
+        uint32_t checksum;
+        /** length of the room id */
+        uint32_t room_length;
+        /** length of the thing id (0 if the state is the whole blueprint) */
+        uint32_t thing_length;
+        /** length of the serialized state */
+        uint32_t state_length;
+        /** version of the room cache when the state was recorded */
+        uint64_t version;
+    };
+
+    /**
+     * Last recorded state of a thing
+     */
+    struct RECORDED_THING {
+        /** serialized state */
+        std::string state;
+        /** version of the room cache when it was recorded */
+        uint64_t version;
+    };
+
+    /**
+     * Last recorded state of a room
+     */
+    struct RECORDED_ROOM {
+        /** highest version recorded for the room */
+        uint64_t version;
+        /** thing id -> last recorded state */
+        std::map<std::string, RECORDED_THING> things;
+
+        RECORDED_ROOM() : version(0) {}
+    };
+
+    /** last recorded state of every room (room id -> room) */
+    typedef std::unordered_map<std::string, RECORDED_ROOM> ROOM_STATES;
+
+    /** Path of the snapshot file (empty if disabled) */
+    static std::string m_filename;
+    /** Whether the snapshot is mapped (records are appended) */
+    static std::atomic<bool> m_is_enabled;
+    /** When false, the snapshot thread quits ASAP */
+    static bool m_is_alive;
+    /** Thread that compacts and writes back the snapshot */
+    static std::thread m_snapshot_thread;
+    /** Protects everything below */
+    static std::mutex m_mutex;
+    /** Descriptor of the snapshot file */
+    static int m_fd;
+    /** Mapped snapshot file (nullptr if there is none, only replaced by the snapshot thread) */
+    static uint8_t* m_data;
+    /** Size of the mapping (and of the file) */
+    static size_t m_capacity;
+    /** Bytes used by the valid records (and the magic) */
+    static size_t m_size;
+    /** Records appended while the mapping was full (moved to the file by the next compaction) */
+    static std::deque<std::string> m_overflow;
+    /** Total size of the records in m_overflow */
+    static size_t m_overflow_size;
+    /** Whether the snapshot thread should compact the file */
+    static bool m_is_compaction_requested;
+    /** Caches of the rooms loaded from the file that did not connect yet */
+    static std::unordered_map<std::string, std::shared_ptr<const AggregatorClient::PUBLISHED_CACHE>> m_stale_rooms;
+
+    /**
+     * Maps a snapshot file
+     * @param fd        Descriptor of the file
+     * @param capacity  Size of the file
+     * @return the mapping, nullptr on failure
+     */
+    static uint8_t* __map(int fd, size_t capacity);
+
+    /**
+     * Unmaps and closes the snapshot file (caller must hold m_mutex)
+     */
+    static void __unmap();
+
+    /**
+     * Flushes the directory holding the snapshot file (makes a rename durable)
+     */
+    static void __syncDirectory();
+
+    /**
+     * @return the checksum of a record
+     */
+    static uint32_t __checksum(const RECORD_HEADER& header, const uint8_t* data);
+
+    /**
+     * Serializes a record
+     * @param dest      Where to write the record (must have room for it)
+     * @param room_id   Room id
+     * @param thing_id  Thing id (empty if state is the whole blueprint)
+     * @param state     Serialized state
+     * @param version   Version of the room cache
+     * @return size of the record
+     */
+    static size_t __writeRecord(uint8_t* dest, const std::string& room_id, const std::string& thing_id, const std::string& state, uint64_t version);
+
+    /**
+     * Replays the records of a snapshot
+     * @param data    Snapshot (starting with the magic)
+     * @param size    Size of the snapshot
+     * @param states  Set to the last recorded state of every thing of every room
+     * @return number of bytes of valid records (and magic) at the start of the snapshot
+     */
+    static size_t __replay(const uint8_t* data, size_t size, ROOM_STATES& states);
+
+    /**
+     * @param state  Serialized blueprint of a room
+     * @param things Set to the serialized state of every thing of the blueprint
+     * @return 0 on success, negative value if state is not an object
+     */
+    static int __splitBlueprint(const std::string& state, std::map<std::string, std::string>& things);
+
+    /**
+     * @param room_id  Room id
+     * @param room     Last recorded state of the room
+     * @return the cache of the room
+     */
+    static std::shared_ptr<const AggregatorClient::PUBLISHED_CACHE> __buildStaleRoom(const std::string& room_id, const RECORDED_ROOM& room);
+
+    /**
+     * Rewrites the snapshot file with only the last state of every thing (through a new file
+     * replacing the old one, so a crash leaves either of them whole). Only called by the
+     * snapshot thread (or once it stopped), m_mutex is only held to swap the files.
+     * @return 0 on success, negative value on failure (the snapshot is disabled)
+     */
+    static int __compact();
+
+    /**
+     * Appends a record to the snapshot, or to m_overflow if the mapping is full, and requests a
+     * compaction when it fills up (caller must hold m_mutex)
+     * @param room_id   Room id
+     * @param thing_id  Thing id (empty if state is the whole blueprint)
+     * @param state     Serialized state
+     * @param version   Version of the room cache
+     */
+    static void __append(const std::string& room_id, const std::string& thing_id, const std::string& state, uint64_t version);
+
+    /**
+     * Snapshot thread entry point
+     */
+    static void __threadEntry();
+
+public:
+    /**
+     * Maps the snapshot file (config cache-snapshot-file) and loads the stale room caches from it
+     * @return 0 on success (or if there is no snapshot file), negative value on failure
+     */
+    static int Initialize();
+
+    /**
+     * Stops the snapshot thread, writes the snapshot back and unmaps it
+     */
+    static void Cleanup();
+
+    /**
+     * @return whether the room caches are persisted
+     */
+    static bool IsEnabled();
+
+    /**
+     * (THREAD SAFE) Records the whole blueprint of a room, replacing what was recorded for it, and
+     * drops its stale cache (its live connection confirmed its state)
+     * @param room_id    Room id
+     * @param blueprint  Serialized blueprint
+     * @param version    Version of the room cache
+     */
+    static void StoreRoom(const std::string& room_id, const std::string& blueprint, uint64_t version);
+
+    /**
+     * (THREAD SAFE) Records the state of a thing of a room
+     * @param room_id   Room id
+     * @param thing_id  Thing id
+     * @param state     Serialized state of the thing
+     * @param version   Version of the room cache when the thing last changed
+     */
+    static void StoreThing(const std::string& room_id, const std::string& thing_id, const std::string& state, uint64_t version);
+
+    /**
+     * (THREAD SAFE) Retrieves the stale cache of a room serialized, with extra fields and its
+     * version (__version) added to it
+     * @param room_id  Room id
+     * @param fields   Serialized members to add to the object, each preceded by a comma
+     * @param key      Thing to retrieve (the whole blueprint if empty)
+     * @return the serialized JSON object, empty if there is no such stale room or thing
+     */
+    static std::string GetSerializedCache(const std::string& room_id, const std::string& fields, const std::string& key = "");
+
+    /**
+     * (THREAD SAFE) Retrieves the things of the stale cache of a room that changed since a version,
+     * serialized with extra fields and the current version (__version) added to them
+     * @param room_id  Room id
+     * @param fields   Serialized members to add to the object, each preceded by a comma
+     * @param version  Version of the cache
+     * @return the serialized JSON object, empty if there is no such stale room
+     */
+    static std::string GetSerializedChanges(const std::string& room_id, const std::string& fields, uint64_t version);
+};
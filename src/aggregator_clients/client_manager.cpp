@@ -2,32 +2,67 @@
 #include "logging/logging.hpp"
 #include "aggregator_clients/client_manager.hpp"
 #include "aggregator_clients/discovery_protocol.hpp"
+#include "aggregator_clients/cache_snapshot.hpp"
 #include "socket_cluster/socket_cluster.hpp"
 #include "verboze_api/verboze_api.hpp"
 #include "utilities/time_utilities.hpp"
 
 #include <fstream>
+#include <cstdio>
 
 bool ClientManager::m_is_alive = true;
 std::thread ClientManager::m_manager_thread;
 std::unordered_map<std::string, ClientManager::AUTHENTICATION_STRUCT> ClientManager::m_credentials_map;
 std::unordered_map<std::string, DISCOVERED_DEVICE> ClientManager::m_clients_require_password;
+std::mutex ClientManager::m_credentials_mutex;
+std::unordered_map<std::string, DISCOVERED_DEVICE> ClientManager::m_known_devices;
+std::unordered_set<std::string> ClientManager::m_pending_rooms;
+std::mutex ClientManager::m_known_devices_mutex;
+milliseconds ClientManager::m_startup_time;
 
-void ClientManager::__onDeviceDiscovered(DISCOVERED_DEVICE dev) {
+void ClientManager::__connectDevice(DISCOVERED_DEVICE dev) {
     // If the middleware on that IP is not registered, attempt to register it
-    if (dev.type == 3 || dev.type == 8) { // type 3 is a middleware, 8 is a secure middleware
-        if (!SocketCluster::IsClientRegistered(dev) && __clientCanAuthenticate(dev)) {
-            SocketClientPtr sc = SocketClient::Create<AggregatorClient> (dev);
-            if (sc) {
-                AggregatorClient* ac = (AggregatorClient*)sc.get();
-                __authenticateClient(ac); // authenticate
-                sc->Write("{\"code\": 0}"_json); // Request blueprint
-            }
+    if (!SocketCluster::IsClientRegistered(dev) && __clientCanAuthenticate(dev)) {
+        SocketClientPtr sc = SocketClient::Create<AggregatorClient> (dev);
+        if (sc) {
+            AggregatorClient* ac = (AggregatorClient*)sc.get();
+            __authenticateClient(ac); // authenticate
+            sc->Write("{\"code\": 0}"_json); // Request blueprint
         }
     }
 }
 
-void ClientManager::OnControlCommandFromAggregatorClient(AggregatorClient* client_from, json command) {
+void ClientManager::__onDeviceDiscovered(DISCOVERED_DEVICE dev) {
+    if (dev.type == 3 || dev.type == 8) { // type 3 is a middleware, 8 is a secure middleware
+        __rememberDevice(dev);
+        __connectDevice(dev);
+    }
+}
+
+void ClientManager::__rememberDevice(const DISCOVERED_DEVICE& dev) {
+    m_known_devices_mutex.lock();
+    auto it = m_known_devices.find(dev.name);
+    if (it == m_known_devices.end() || it->second.interface != dev.interface || it->second.ip != dev.ip ||
+        it->second.port != dev.port || it->second.type != dev.type || it->second.data != dev.data) {
+        LOG(debug) << "Middleware " << dev.name << " is now known at " << dev.ip << ":" << dev.port << " (" << dev.interface << ")";
+        m_known_devices[dev.name] = dev;
+        __writeKnownDevices();
+    }
+    m_known_devices_mutex.unlock();
+}
+
+void ClientManager::OnRoomOnline(AggregatorClient* client) {
+    m_known_devices_mutex.lock();
+    if (m_pending_rooms.erase(client->m_discovery_info.name) > 0) {
+        milliseconds elapsed = __get_monotonic_time_ms() - m_startup_time;
+        LOG(debug) << "Room " << client->GetID() << " online " << elapsed.count() << " ms after startup (" << m_pending_rooms.size() << " known rooms left)";
+        if (m_pending_rooms.size() == 0)
+            LOG(info) << "All the known rooms are online " << elapsed.count() << " ms after startup";
+    }
+    m_known_devices_mutex.unlock();
+}
+
+void ClientManager::OnControlCommandFromAggregatorClient(AggregatorClient* client_from, json&& command) {
     std::string client_name = client_from->GetID();
     if (command.find("code") == command.end() || !command["code"].is_number()) {
         LOG(warning) << "Received control command from " << client_name << " without code " << command.dump();
@@ -44,6 +79,7 @@ void ClientManager::OnControlCommandFromAggregatorClient(AggregatorClient* clien
 
         case CONTROL_CODE_GET_BLUEPRINT:
         case CONTROL_CODE_GET_THING_STATE:
+        case CONTROL_CODE_GET_CHANGES:
         case CONTROL_CODE_SET_LISTENERS:
         case CONTROL_CODE_SET_QRCODE:
             LOG(warning) << "Received unsupported control code " << code << " from " << client_name;
@@ -53,30 +89,37 @@ void ClientManager::OnControlCommandFromAggregatorClient(AggregatorClient* clien
     }
 }
 
-void ClientManager::__onControlCommandFromVerboze(json command, int code, AggregatorClient* target_room) {
+void ClientManager::__onControlCommandFromVerboze(json&& command, int code, const std::string& room_id, AggregatorClient* target_room) {
+    // only the routing fields are serialized per request, the cached states are spliced as they are
+    // (rooms that are not connected are answered from the snapshot of their cache, marked stale)
     auto reply_target = command.find("__reply_target");
+    std::string routing = ",\"__room_id\":" + json(room_id).dump();
+    if (reply_target != command.end())
+        routing += ",\"__reply_target\":" + reply_target->dump();
+    if (!target_room)
+        routing += ",\"__stale\":true";
 
+    std::string response;
     switch (code) {
         case CONTROL_CODE_GET_BLUEPRINT: {
-            json blueprint = target_room->GetCache();
-            blueprint["__room_id"] = target_room->GetID();
-            if (reply_target != command.end())
-                blueprint["__reply_target"] = command["__reply_target"];
-            VerbozeAPI::SendCommand(blueprint);
+            response = target_room ? target_room->GetSerializedCache(routing) : CacheSnapshot::GetSerializedCache(room_id, routing);
             break;
         } case CONTROL_CODE_GET_THING_STATE: {
-            if (command.find("thing-id") != command.end() && command["thing-id"].is_string()) {
-                std::string thing_id = command["thing-id"];
-                json thing_state = target_room->GetCache(thing_id);
-                if (!thing_state.is_null()) {
-                    thing_state["thing"] = thing_id;
-                    thing_state["__room_id"] = target_room->GetID();
-                    if (reply_target != command.end())
-                        thing_state["__reply_target"] = command["__reply_target"];
-                    VerbozeAPI::SendCommand(thing_state);
-                }
+            auto thing_id = command.find("thing-id");
+            if (thing_id != command.end() && thing_id->is_string()) {
+                const std::string& key = thing_id->get_ref<const std::string&>();
+                std::string fields = ",\"thing\":" + thing_id->dump() + routing;
+                response = target_room ? target_room->GetSerializedCache(fields, key) : CacheSnapshot::GetSerializedCache(room_id, fields, key);
             }
             break;
+        } case CONTROL_CODE_GET_CHANGES: {
+            // things changed since the version Verboze has (the whole blueprint if it has none)
+            uint64_t version = 0;
+            auto since = command.find("since");
+            if (since != command.end() && since->is_number_unsigned())
+                version = since->get<uint64_t>();
+            response = target_room ? target_room->GetSerializedChanges(routing, version) : CacheSnapshot::GetSerializedChanges(room_id, routing, version);
+            break;
         } case CONTROL_CODE_SET_LISTENERS: {
             /** CANNOT BE IMPLEMENTED HERE! (Verboze listens to all) */
             break;
@@ -84,42 +127,39 @@ void ClientManager::__onControlCommandFromVerboze(json command, int code, Aggreg
             /** CANNOT BE IMPLEMENTED HERE! (This is only sent by clients...) */
         } case CONTROL_CODE_SET_QRCODE: {
             // forward the new QR code to the room
+            if (!target_room)
+                break;
             if (command.find("qr-code") != command.end())
                 command["qr-code"] = VerbozeAPI::TokenToStreamURL(command["qr-code"], true);
             target_room->Write(command);
         }
     }
+
+    if (response.size() > 0)
+        VerbozeAPI::SendSerializedCommand(std::move(response));
 }
 
-void ClientManager::__onCommandFromVerboze(json command) {
+void ClientManager::__onCommandFromVerboze(json&& command) {
     auto command_it = command.find("__room_id");
     if (command_it != command.end() && command_it.value().is_string()) {
         std::string room_id = command_it.value();
         command.erase("__room_id");
 
-        AggregatorClient* target_room = nullptr;
-        std::vector<SocketClientPtr> all_clients = SocketCluster::GetClientsList();
-        for (auto it : all_clients) {
-            AggregatorClient* cl = (AggregatorClient*)(it.get());
-            if (cl->GetID() == room_id) {
-                target_room = cl;
-                break;
-            }
-        }
+        // the reference keeps target_room alive until the command is handled
+        SocketClientPtr client = SocketCluster::GetClientByRoom(room_id);
+        AggregatorClient* target_room = (AggregatorClient*)(client.get());
 
-        if (target_room) {
-            if (command.find("thing") == command.end()) {
-                // control command, handle it now
-                auto code_iter = command.find("code");
-                if (code_iter != command.end()) {
-                    int code = code_iter.value();
-                    __onControlCommandFromVerboze(command, code, target_room);
-                }
-                return;
-            } else {
-                // state update, just forward it to the respective middleware
-                target_room->Write(command);
+        if (command.find("thing") == command.end()) {
+            // control command, handle it now (even if the room is not connected)
+            auto code_iter = command.find("code");
+            if (code_iter != command.end()) {
+                int code = code_iter.value();
+                __onControlCommandFromVerboze(std::move(command), code, room_id, target_room);
             }
+            return;
+        } else if (target_room) {
+            // state update, just forward it to the respective middleware
+            target_room->Write(command);
         }
     }
 }
@@ -127,7 +167,6 @@ void ClientManager::__onCommandFromVerboze(json command) {
 void ClientManager::__threadEntry() {
     milliseconds cur_time = __get_time_ms();
 
-    milliseconds next_heartbeat_round = cur_time;
     milliseconds next_discovery_round = cur_time;
 
     while (m_is_alive) {
@@ -137,16 +176,9 @@ void ClientManager::__threadEntry() {
             DiscoveryProtocol::InitiateDiscovery(&__onDeviceDiscovered);
         }
 
-        if (cur_time >= next_heartbeat_round - milliseconds(100)) {
-            next_heartbeat_round = cur_time + milliseconds(HEARTBEAT_PERIOD);
-
-            std::vector<SocketClientPtr> all_clients = SocketCluster::GetClientsList();
-            for (auto it : all_clients)
-                it->Write(json::object());
-        }
-
-        milliseconds sleep_time = std::min(next_heartbeat_round - cur_time,
-                                           next_discovery_round - cur_time);
+        // heartbeats and idle clients are handled by the SocketCluster reactors
+        milliseconds sleep_time = std::min(next_discovery_round - cur_time,
+                                           milliseconds(MANAGER_SLEEP_PERIOD));
 
         std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time));
 
@@ -156,14 +188,32 @@ void ClientManager::__threadEntry() {
 
 int ClientManager::Initialize() {
     m_is_alive = true;
+    m_startup_time = __get_monotonic_time_ms();
 
     // Load stored credentials
     __readCredentialsMap();
 
-    m_manager_thread = std::thread(__threadEntry);
+    // Load the room caches persisted before the restart
+    if (CacheSnapshot::Initialize() != 0)
+        return -1;
 
     VerbozeAPI::SetCommandCallback(__onCommandFromVerboze);
 
+    // Connect to the middlewares known before the restart right away (the connections are
+    // established in parallel by the reactors), discovery only picks up the changes
+    __readKnownDevices();
+    std::vector<DISCOVERED_DEVICE> known_devices;
+    m_known_devices_mutex.lock();
+    for (auto it = m_known_devices.begin(); it != m_known_devices.end(); it++) {
+        known_devices.push_back(it->second);
+        m_pending_rooms.insert(it->first);
+    }
+    m_known_devices_mutex.unlock();
+    for (auto it = known_devices.begin(); it != known_devices.end(); it++)
+        __connectDevice(*it);
+
+    m_manager_thread = std::thread(__threadEntry);
+
     return 0;
 }
 
@@ -172,10 +222,14 @@ void ClientManager::Cleanup() {
 
     if (m_manager_thread.joinable())
         m_manager_thread.join();
+
+    CacheSnapshot::Cleanup();
 }
 
 bool ClientManager::__clientCanAuthenticate(DISCOVERED_DEVICE dev) {
+    bool can_authenticate = true;
     std::string client_key = __getClientCredentialsMapKey(dev);
+    m_credentials_mutex.lock();
     auto it = m_credentials_map.find(client_key);
     if (it == m_credentials_map.end()) {
         std::string pw = ConfigManager::get<std::string>("credentials-password");
@@ -183,29 +237,41 @@ bool ClientManager::__clientCanAuthenticate(DISCOVERED_DEVICE dev) {
             // Generate a new token and set its password since we know what password to always use
             __generateNewAuthenticationToken(dev);
             m_credentials_map.find(client_key)->second.password = pw;
-            return true;
+        } else {
+            // this client has no authentication info, add it to the m_clients_require_password (if it doesn't exist)
+            can_authenticate = __markClientRequiresPassword(dev);
         }
-        // this client has no authentication info, add it to the m_clients_require_password (if it doesn't exist)
-        return __markClientRequiresPassword(dev);
     }
-    return true;
+    m_credentials_mutex.unlock();
+    return can_authenticate;
 }
 
 void ClientManager::__authenticateClient(AggregatorClient* client) {
     std::string client_key = __getClientCredentialsMapKey(client->m_discovery_info);
+    json authentication;
+    m_credentials_mutex.lock();
     auto iter = m_credentials_map.find(client_key);
     if (iter != m_credentials_map.end())
-        client->Write(iter->second.get_json_and_clear_password()); // Authenticate
+        authentication = iter->second.get_json_and_clear_password();
+    m_credentials_mutex.unlock();
+    if (!authentication.is_null()) {
+        // middlewares that support one of the codecs reply with {"codec": <name>}, others ignore it
+        authentication["codecs"] = ConfigManager::get<std::vector<std::string>>("middleware-codecs");
+        client->m_is_negotiating_codec = true;
+        client->Write(authentication); // Authenticate
+    }
 }
 
 void ClientManager::RemoveClientCredentials(AggregatorClient* client) {
     std::string client_key = __getClientCredentialsMapKey(client->m_discovery_info);
     LOG(warning) << "Credentials for client " << client_key << " no longer works.";
+    m_credentials_mutex.lock();
     m_credentials_map.erase(client_key);
     __writeCredentialsMap();
 
     // add this client to the list of clients that require password to authenticate (since it failed - it needs a new token)
     __markClientRequiresPassword(client->m_discovery_info);
+    m_credentials_mutex.unlock();
 }
 
 std::string ClientManager::__getClientCredentialsMapKey(DISCOVERED_DEVICE dev) {
@@ -258,6 +324,72 @@ void ClientManager::__writeCredentialsMap() {
     }
 }
 
+void ClientManager::__readKnownDevices() {
+    std::string filename = ConfigManager::get<std::string>("known-devices-file");
+    if (filename.size() == 0)
+        return;
+
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        LOG(info) << "No known devices file " << filename << ", waiting for discovery";
+        return;
+    }
+    json devices;
+    try {
+        devices = json::parse(file);
+    } catch (...) {}
+    if (!devices.is_array()) {
+        LOG(warning) << "Failed to read known devices file " << filename;
+        return;
+    }
+
+    m_known_devices_mutex.lock();
+    for (auto it = devices.begin(); it != devices.end(); it++) {
+        try {
+            DISCOVERED_DEVICE dev;
+            dev.interface = (*it)["interface"];
+            dev.name = (*it)["name"];
+            dev.ip = (*it)["ip"];
+            dev.port = (*it)["port"];
+            dev.type = (*it)["type"];
+            dev.data = (*it)["data"];
+            m_known_devices[dev.name] = dev;
+        } catch (...) {
+            LOG(warning) << "Ignoring invalid known device " << it->dump();
+        }
+    }
+    LOG(info) << "Using known devices file " << filename << " (" << m_known_devices.size() << " middlewares)";
+    m_known_devices_mutex.unlock();
+}
+
+void ClientManager::__writeKnownDevices() {
+    std::string filename = ConfigManager::get<std::string>("known-devices-file");
+    if (filename.size() == 0)
+        return;
+
+    json devices = json::array();
+    for (auto it = m_known_devices.begin(); it != m_known_devices.end(); it++) {
+        devices.push_back({
+            {"interface", it->second.interface},
+            {"name", it->second.name},
+            {"ip", it->second.ip},
+            {"port", it->second.port},
+            {"type", it->second.type},
+            {"data", it->second.data},
+        });
+    }
+
+    // through a new file replacing the old one, so a crash leaves either of them whole
+    std::string tmp_filename = filename + ".tmp";
+    std::ofstream file(tmp_filename, std::ios::out | std::ios::trunc);
+    if (file.is_open()) {
+        file << devices.dump(4) << std::endl;
+        file.close();
+    }
+    if (!file || rename(tmp_filename.c_str(), filename.c_str()) != 0)
+        LOG(warning) << "Failed to write known devices file " << filename;
+}
+
 std::string ClientManager::__generateNewAuthenticationToken(DISCOVERED_DEVICE dev) {
     // letters a-z, A-Z, and numbers 0-9
     const int num_symbols = 26 * 2 + 10;
@@ -3,17 +3,21 @@
 #include "aggregator_clients/aggregator_client.hpp"
 #include "aggregator_clients/discovery_protocol.hpp"
 
+#include "utilities/time_utilities.hpp"
+
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <thread>
+#include <mutex>
 
 #include <json.hpp>
 using json = nlohmann::json;
 
 /** Period for discovery requests */
 #define DISCOVERY_PERIOD 30000
-/** Period for heartbeats */
-#define HEARTBEAT_PERIOD 8000
+/** Maximum time the manager thread sleeps at once (bounds the time Cleanup() waits for it) */
+#define MANAGER_SLEEP_PERIOD 1000
 
 /** Control codes */
 #define CONTROL_CODE_GET_BLUEPRINT      0
@@ -21,6 +25,7 @@ using json = nlohmann::json;
 #define CONTROL_CODE_SET_LISTENERS      2
 #define CONTROL_CODE_RESET_QRCODE       3
 #define CONTROL_CODE_SET_QRCODE         4
+#define CONTROL_CODE_GET_CHANGES        5
 
 class ClientManager {
     /** Holds authentication  */
@@ -61,6 +66,16 @@ class ClientManager {
     static std::unordered_map<std::string, AUTHENTICATION_STRUCT> m_credentials_map;
     /** Clients that need a password to authenticate */
     static std::unordered_map<std::string, DISCOVERED_DEVICE> m_clients_require_password;
+    /** Protects m_credentials_map and m_clients_require_password (accessed from the discovery and reactor threads) */
+    static std::mutex m_credentials_mutex;
+    /** Last known info of every middleware (device name -> device), persisted in the known devices file */
+    static std::unordered_map<std::string, DISCOVERED_DEVICE> m_known_devices;
+    /** Names of the middlewares known at startup whose room did not come online yet */
+    static std::unordered_set<std::string> m_pending_rooms;
+    /** Protects m_known_devices and m_pending_rooms (accessed from the discovery and reactor threads) */
+    static std::mutex m_known_devices_mutex;
+    /** Monotonic time at which the manager was initialized */
+    static milliseconds m_startup_time;
 
     /**
      * Checks whether or not authentication can be made to a client
@@ -86,7 +101,7 @@ class ClientManager {
     /**
      * Mark a client that it needs a password to authenticate. If there is a default
      * password set, the function will use it immediately and put it in m_credentials_map
-     * for the given client and return true.
+     * for the given client and return true. Caller must hold m_credentials_mutex.
      * @param client  Discovered device info of client
      * @return        true iff the client has a password ready in m_credentials_map
      */
@@ -98,18 +113,42 @@ class ClientManager {
     static void __readCredentialsMap();
 
     /**
-     * Writes m_credentials_map from file (filename in config)
+     * Writes m_credentials_map from file (filename in config) (caller must hold m_credentials_mutex)
      */
     static void __writeCredentialsMap();
 
     /**
      * Generates a new authentication token and stores it in m_credentials_map and
-     * in the credentials file (if provided).
+     * in the credentials file (if provided). Caller must hold m_credentials_mutex.
      * @param dev     Discovered device info to associate token with
      * @return        Newly generated authentication token
      */
     static std::string __generateNewAuthenticationToken(DISCOVERED_DEVICE dev);
 
+    /**
+     * Reads m_known_devices from file (filename in config)
+     */
+    static void __readKnownDevices();
+
+    /**
+     * Writes m_known_devices to file (filename in config) (caller must hold m_known_devices_mutex)
+     */
+    static void __writeKnownDevices();
+
+    /**
+     * Records the info of a middleware in m_known_devices (and in the known devices file if it
+     * is new or changed)
+     * @param dev  Discovered device info
+     */
+    static void __rememberDevice(const DISCOVERED_DEVICE& dev);
+
+    /**
+     * Connects to a middleware (and requests its blueprint) unless it is already connected or
+     * cannot authenticate
+     * @param dev  Device info of the middleware
+     */
+    static void __connectDevice(DISCOVERED_DEVICE dev);
+
     /**
      * Called by the discovery system (from another thread) when a device is discovered.
      * @param dev  Discovered device info
@@ -118,17 +157,19 @@ class ClientManager {
 
     /**
      * Callback called by the VerbozeAPI when a command is sent
-     * @param command The JSON command
+     * @param command The JSON command (handed over by the websocket)
      */
-    static void __onCommandFromVerboze(json command);
+    static void __onCommandFromVerboze(json&& command);
 
     /**
      * Responds to a control command from Verboze
      * @param command      Control command sent by Verboze
      * @param code         Control code
-     * @param target_room  Pointer to the target room
+     * @param room_id      Id of the target room
+     * @param target_room  Pointer to the target room (nullptr if it is not connected, queries are
+     *                     then answered from the cache snapshot)
      */
-    static void __onControlCommandFromVerboze(json command, int code, AggregatorClient* target_room);
+    static void __onControlCommandFromVerboze(json&& command, int code, const std::string& room_id, AggregatorClient* target_room);
 
     /**
      * Thread entry point
@@ -153,11 +194,17 @@ public:
      */
     static void RemoveClientCredentials(AggregatorClient* client);
 
+    /**
+     * (THREAD SAFE) Called when an aggregator client receives the id of its room
+     * @param client  Client whose room came online
+     */
+    static void OnRoomOnline(AggregatorClient* client);
+
     /*
      * Called when an aggregator client sends a control message
      * @param client_from  Client that sent the message
-     * @param command      Command sent by the client
+     * @param command      Command sent by the client (handed over, it is stamped and forwarded)
      */
-    static void OnControlCommandFromAggregatorClient(AggregatorClient* client_from, json command);
+    static void OnControlCommandFromAggregatorClient(AggregatorClient* client_from, json&& command);
 };
 
@@ -0,0 +1,421 @@
+#include "aggregator_clients/state_store.hpp"
+#include "utilities/time_utilities.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+std::shared_timed_mutex StateStore::m_names_mutex;
+std::unordered_map<std::string, uint32_t> StateStore::m_name_ids;
+std::deque<std::string> StateStore::m_names;
+std::atomic<uint64_t> StateStore::m_min_version(0);
+
+/**
+ * Merges JSON data into a JSON object recursing on OBJECT types (for the values nested below the properties)
+ * @param  base     The base JSON object that will be modified (type must be OBJECT)
+ * @param  new_data The data to merge into base (type must be OBJECT)
+ * @param  delta    If not nullptr, the entries that changed are added to it
+ * @return          true if anything changed, false otherwise
+ */
+static bool __merge_json(json& base, const json& new_data, json* delta) {
+    bool is_changed = false;
+    for (auto it = new_data.begin(); it != new_data.end(); it++) {
+        auto existing_entry = base.find(it.key());
+        if (existing_entry != base.end() && existing_entry->is_object() && it->is_object()) {
+            json sub_delta;
+            if (__merge_json(*existing_entry, *it, delta ? &sub_delta : nullptr)) {
+                is_changed = true;
+                if (delta)
+                    (*delta)[it.key()] = std::move(sub_delta);
+            }
+        } else if (existing_entry == base.end() || *existing_entry != *it) {
+            base[it.key()] = *it;
+            is_changed = true;
+            if (delta)
+                (*delta)[it.key()] = *it;
+        }
+    }
+    return is_changed;
+}
+
+/*******************************************************************************************
+ * VALUE
+ *******************************************************************************************/
+
+StateStore::VALUE::VALUE() : m_type(json::value_t::null), m_unsigned(0) {
+}
+
+StateStore::VALUE::VALUE(const json& value) : m_type(value.type()), m_unsigned(0) {
+    switch (m_type) {
+        case json::value_t::boolean:
+            m_boolean = value.get<bool>();
+            break;
+        case json::value_t::number_integer:
+            m_integer = value.get<int64_t>();
+            break;
+        case json::value_t::number_unsigned:
+            m_unsigned = value.get<uint64_t>();
+            break;
+        case json::value_t::number_float:
+            m_float = value.get<double>();
+            break;
+        case json::value_t::string: {
+            const std::string& str = value.get_ref<const std::string&>();
+            uint32_t length = (uint32_t)str.size();
+            m_string = new char[sizeof(length) + length];
+            memcpy(m_string, &length, sizeof(length));
+            memcpy(m_string + sizeof(length), str.data(), length);
+            break;
+        } case json::value_t::object:
+        case json::value_t::array:
+            m_structured = new json(value);
+            break;
+        default:
+            m_type = json::value_t::null;
+    }
+}
+
+StateStore::VALUE::VALUE(const VALUE& other) : m_type(json::value_t::null), m_unsigned(0) {
+    __copy(other);
+}
+
+StateStore::VALUE::VALUE(VALUE&& other) : m_type(other.m_type), m_unsigned(other.m_unsigned) {
+    // the pointers are taken over
+    other.m_type = json::value_t::null;
+    other.m_unsigned = 0;
+}
+
+StateStore::VALUE& StateStore::VALUE::operator=(const VALUE& other) {
+    if (this != &other) {
+        __clear();
+        __copy(other);
+    }
+    return *this;
+}
+
+StateStore::VALUE& StateStore::VALUE::operator=(VALUE&& other) {
+    if (this != &other) {
+        __clear();
+        m_type = other.m_type;
+        m_unsigned = other.m_unsigned;
+        other.m_type = json::value_t::null;
+        other.m_unsigned = 0;
+    }
+    return *this;
+}
+
+StateStore::VALUE::~VALUE() {
+    __clear();
+}
+
+void StateStore::VALUE::__clear() {
+    if (m_type == json::value_t::string)
+        delete[] m_string;
+    else if (m_type == json::value_t::object || m_type == json::value_t::array)
+        delete m_structured;
+    m_type = json::value_t::null;
+    m_unsigned = 0;
+}
+
+void StateStore::VALUE::__copy(const VALUE& other) {
+    m_type = other.m_type;
+    if (m_type == json::value_t::string) {
+        uint32_t length;
+        memcpy(&length, other.m_string, sizeof(length));
+        m_string = new char[sizeof(length) + length];
+        memcpy(m_string, other.m_string, sizeof(length) + length);
+    } else if (m_type == json::value_t::object || m_type == json::value_t::array)
+        m_structured = new json(*other.m_structured);
+    else
+        m_unsigned = other.m_unsigned;
+}
+
+json StateStore::VALUE::ToJson() const {
+    switch (m_type) {
+        case json::value_t::boolean:
+            return m_boolean;
+        case json::value_t::number_integer:
+            return m_integer;
+        case json::value_t::number_unsigned:
+            return m_unsigned;
+        case json::value_t::number_float:
+            return m_float;
+        case json::value_t::string: {
+            uint32_t length;
+            memcpy(&length, m_string, sizeof(length));
+            return std::string(m_string + sizeof(length), length);
+        } case json::value_t::object:
+        case json::value_t::array:
+            return *m_structured;
+        default:
+            return json();
+    }
+}
+
+bool StateStore::VALUE::Equals(const json& value) const {
+    switch (m_type) {
+        case json::value_t::boolean:
+            return value.is_boolean() && value.get<bool>() == m_boolean;
+        case json::value_t::number_integer:
+        case json::value_t::number_unsigned:
+        case json::value_t::number_float:
+            // numbers of different types are compared by value
+            if (!value.is_number())
+                return false;
+            if (m_type == json::value_t::number_float || value.is_number_float())
+                return ToJson().get<double>() == value.get<double>();
+            if (m_type == json::value_t::number_integer && m_integer < 0)
+                return value.is_number_integer() && !value.is_number_unsigned() && value.get<int64_t>() == m_integer;
+            return (value.is_number_unsigned() || value.get<int64_t>() >= 0) && value.get<uint64_t>() == (m_type == json::value_t::number_unsigned ? m_unsigned : (uint64_t)m_integer);
+        case json::value_t::string: {
+            if (!value.is_string())
+                return false;
+            const std::string& str = value.get_ref<const std::string&>();
+            uint32_t length;
+            memcpy(&length, m_string, sizeof(length));
+            return str.size() == length && memcmp(str.data(), m_string + sizeof(length), length) == 0;
+        } case json::value_t::object:
+        case json::value_t::array:
+            return value.type() == m_type && *m_structured == value;
+        default:
+            return value.is_null();
+    }
+}
+
+size_t StateStore::VALUE::GetHeapSize() const {
+    if (m_type == json::value_t::string) {
+        uint32_t length;
+        memcpy(&length, m_string, sizeof(length));
+        return sizeof(length) + length;
+    } else if (m_type == json::value_t::object || m_type == json::value_t::array)
+        return sizeof(json) + m_structured->dump().size(); // rough, nested values are rare
+    return 0;
+}
+
+/*******************************************************************************************
+ * STORE
+ *******************************************************************************************/
+
+StateStore::StateStore() : m_version(__getInitialVersion()) {
+}
+
+uint64_t StateStore::__getInitialVersion() {
+    // the wall clock orders the runs of the process, the monotonic clock never goes back within one
+    static const uint64_t start_time = (uint64_t)duration_cast<microseconds>(__get_time_ms()).count();
+    static const microseconds start_monotonic_time = __get_monotonic_time_us();
+    uint64_t elapsed = (uint64_t)(__get_monotonic_time_us() - start_monotonic_time).count();
+    return std::max(start_time, m_min_version.load()) + elapsed;
+}
+
+void StateStore::SetMinVersion(uint64_t version) {
+    uint64_t min_version = m_min_version.load();
+    while (version > min_version && !m_min_version.compare_exchange_weak(min_version, version)) {}
+}
+
+uint32_t StateStore::__intern(const std::string& name) {
+    uint32_t id;
+    if (__findId(name, &id))
+        return id;
+
+    m_names_mutex.lock(); // write (exclusive) lock
+    auto it = m_name_ids.find(name); // may have been interned since the lookup
+    if (it == m_name_ids.end()) {
+        it = m_name_ids.insert(std::make_pair(name, (uint32_t)m_names.size())).first;
+        m_names.push_back(name);
+    }
+    id = it->second;
+    m_names_mutex.unlock();
+    return id;
+}
+
+bool StateStore::__findId(const std::string& name, uint32_t* id) {
+    m_names_mutex.lock_shared(); // read lock
+    auto it = m_name_ids.find(name);
+    bool is_found = it != m_name_ids.end();
+    if (is_found)
+        *id = it->second;
+    m_names_mutex.unlock_shared();
+    return is_found;
+}
+
+const StateStore::THING* StateStore::__findThing(uint32_t id) const {
+    auto it = std::lower_bound(m_things.begin(), m_things.end(), id, [](const THING& thing, uint32_t id) { return thing.id < id; });
+    return it != m_things.end() && it->id == id ? &*it : nullptr;
+}
+
+StateStore::THING& StateStore::__getThing(uint32_t id, bool* is_new) {
+    auto it = std::lower_bound(m_things.begin(), m_things.end(), id, [](const THING& thing, uint32_t id) { return thing.id < id; });
+    *is_new = it == m_things.end() || it->id != id;
+    if (*is_new) {
+        THING thing;
+        thing.id = id;
+        thing.is_object = false;
+        thing.version = 0;
+        it = m_things.insert(it, std::move(thing));
+    }
+    return *it;
+}
+
+bool StateStore::__mergeValue(VALUE& base, const json& new_data, json* delta) {
+    if (base.is_object() && new_data.is_object())
+        return __merge_json(*base.structured(), new_data, delta);
+    if (base.Equals(new_data))
+        return false;
+    base = VALUE(new_data);
+    if (delta)
+        *delta = new_data;
+    return true;
+}
+
+bool StateStore::__mergeProperties(THING& thing, const json& new_data, json* delta) {
+    bool is_changed = false;
+    for (auto it = new_data.begin(); it != new_data.end(); it++) {
+        uint32_t id = __intern(it.key());
+        auto property = std::lower_bound(thing.properties.begin(), thing.properties.end(), id, [](const PROPERTY& property, uint32_t id) { return property.id < id; });
+        if (property == thing.properties.end() || property->id != id) {
+            PROPERTY new_property;
+            new_property.id = id;
+            new_property.value = VALUE(*it);
+            thing.properties.insert(property, std::move(new_property));
+            is_changed = true;
+            if (delta)
+                (*delta)[it.key()] = *it;
+        } else {
+            json value_delta;
+            if (__mergeValue(property->value, *it, delta ? &value_delta : nullptr)) {
+                is_changed = true;
+                if (delta)
+                    (*delta)[it.key()] = std::move(value_delta);
+            }
+        }
+    }
+    return is_changed;
+}
+
+json StateStore::__thingToJson(const THING& thing) {
+    if (!thing.is_object)
+        return thing.value.ToJson();
+    json state = json::object();
+    for (auto it = thing.properties.begin(); it != thing.properties.end(); it++)
+        state[m_names[it->id]] = it->value.ToJson();
+    return state;
+}
+
+bool StateStore::Merge(const json& new_data, json* delta) {
+    if (delta)
+        *delta = json::object();
+    if (!new_data.is_object())
+        return false;
+
+    bool is_changed = false;
+    for (auto it = new_data.begin(); it != new_data.end(); it++) {
+        bool is_new;
+        THING& thing = __getThing(__intern(it.key()), &is_new);
+        json thing_delta; // only allocated if something changed
+        bool is_thing_changed = false;
+        if (it->is_object()) {
+            if (!thing.is_object) {
+                // a new thing (or one that was not an object), replaced by an empty object first
+                thing.is_object = true;
+                thing.value = VALUE();
+                thing_delta = json::object();
+                is_thing_changed = true;
+            }
+            if (__mergeProperties(thing, *it, delta ? &thing_delta : nullptr))
+                is_thing_changed = true;
+        } else if (is_new || thing.is_object || !thing.value.Equals(*it)) {
+            thing.is_object = false;
+            thing.properties.clear();
+            thing.value = VALUE(*it);
+            thing_delta = *it;
+            is_thing_changed = true;
+        }
+
+        if (is_thing_changed) {
+            is_changed = true;
+            thing.version = m_version + 1;
+            if (delta)
+                (*delta)[it.key()] = std::move(thing_delta);
+        }
+    }
+    if (is_changed)
+        m_version++;
+    return is_changed;
+}
+
+json StateStore::ToJson() const {
+    json blueprint = json::object();
+    m_names_mutex.lock_shared(); // read lock
+    for (auto it = m_things.begin(); it != m_things.end(); it++)
+        blueprint[m_names[it->id]] = __thingToJson(*it);
+    m_names_mutex.unlock_shared();
+    return blueprint;
+}
+
+json StateStore::GetThing(const std::string& thing_id) const {
+    uint32_t id;
+    if (!__findId(thing_id, &id))
+        return json();
+    const THING* thing = __findThing(id);
+    if (!thing)
+        return json();
+    m_names_mutex.lock_shared(); // read lock
+    json state = __thingToJson(*thing);
+    m_names_mutex.unlock_shared();
+    return state;
+}
+
+bool StateStore::DumpThing(const std::string& thing_id, std::string* state, uint64_t* version) const {
+    uint32_t id;
+    if (!__findId(thing_id, &id))
+        return false;
+    const THING* thing = __findThing(id);
+    if (!thing)
+        return false;
+    m_names_mutex.lock_shared(); // read lock
+    *state = __thingToJson(*thing).dump();
+    m_names_mutex.unlock_shared();
+    *version = thing->version;
+    return true;
+}
+
+std::vector<std::string> StateStore::GetThingIds() const {
+    std::vector<std::string> ids;
+    ids.reserve(m_things.size());
+    m_names_mutex.lock_shared(); // read lock
+    for (auto it = m_things.begin(); it != m_things.end(); it++)
+        ids.push_back(m_names[it->id]);
+    m_names_mutex.unlock_shared();
+    return ids;
+}
+
+uint64_t StateStore::GetVersion() const {
+    return m_version;
+}
+
+std::string StateStore::SpliceFields(const std::string& object, const std::string& fields) {
+    std::string serialized;
+    if (object.size() >= 2 && object.front() == '{') {
+        // the fields go before the closing brace (the object is copied once, as is)
+        bool is_empty = object.size() == 2;
+        serialized.reserve(object.size() + fields.size());
+        serialized.append(object, 0, object.size() - 1);
+        serialized.append(fields, is_empty && fields.size() > 0 ? 1 : 0, std::string::npos);
+        serialized.push_back('}');
+    }
+    return serialized;
+}
+
+void StateStore::Clear() {
+    m_things.clear();
+}
+
+size_t StateStore::GetMemoryUsage() const {
+    size_t size = sizeof(*this) + m_things.capacity() * sizeof(THING);
+    for (auto it = m_things.begin(); it != m_things.end(); it++) {
+        size += it->properties.capacity() * sizeof(PROPERTY) + it->value.GetHeapSize();
+        for (auto property = it->properties.begin(); property != it->properties.end(); property++)
+            size += property->value.GetHeapSize();
+    }
+    return size;
+}
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <json.hpp>
+using json = nlohmann::json;
+
+#include <shared_mutex>
+#include <atomic>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Compact cache of the state of the things of a room (NOT thread safe), replacing a JSON DOM
+ * of the blueprint.
+ *
+ * A blueprint is an object of things, each an object of properties holding (mostly) scalars.
+ * The store keeps it flat:
+ *     - thing and property names are interned once for the whole process (every room has the
+ *       same few property names and similar thing names), and referred to by a 32 bit id
+ *     - every thing is a vector of properties sorted by id, and the things are a vector sorted
+ *       by id, so a lookup is a binary search and there is no node allocation per key
+ *     - values are a 16 bytes tagged union, only strings (and the rare nested objects/arrays)
+ *       live in a separate allocation
+ *
+ * Merge() has the semantics of merging a JSON object into the blueprint (objects are merged
+ * recursively, anything else replaces the old value unless it is equal), and gives the delta
+ * of what actually changed. ToJson() rebuilds the DOM. The serialized states are not kept here,
+ * the AggregatorClient publishes them (see AggregatorClient::PUBLISHED_CACHE).
+ *
+ * Every merge that changes the store increments its version, and the changed things remember it,
+ * so the things changed since a version can be retrieved. Versions start at the wall clock time
+ * (in microseconds) of the first store of the process advanced by the monotonic clock, and above
+ * the last version persisted before a restart (see SetMinVersion()), so the versions of a store
+ * are above those of the stores it replaced (e.g. before a reconnection or a restart, even if the
+ * wall clock went back) and asking it for the changes since one of those gives all of its things.
+ */
+class StateStore {
+public:
+    /**
+     * A JSON value stored in 16 bytes (type + payload)
+     */
+    class VALUE {
+        /** type of the value (objects and arrays are held in a json) */
+        json::value_t m_type;
+        union {
+            bool m_boolean;
+            int64_t m_integer;
+            uint64_t m_unsigned;
+            double m_float;
+            /** string (length prefixed, not null terminated) */
+            char* m_string;
+            /** object or array */
+            json* m_structured;
+        };
+
+        /** Frees m_string/m_structured */
+        void __clear();
+
+        /** Copies the value of other (must be empty) */
+        void __copy(const VALUE& other);
+
+    public:
+        VALUE();
+        VALUE(const json& value);
+        VALUE(const VALUE& other);
+        VALUE(VALUE&& other);
+        VALUE& operator=(const VALUE& other);
+        VALUE& operator=(VALUE&& other);
+        ~VALUE();
+
+        /** @return the type of the value */
+        json::value_t type() const { return m_type; }
+
+        /** @return whether the value is an object (merged into instead of replaced) */
+        bool is_object() const { return m_type == json::value_t::object; }
+
+        /** @return the object or array held by the value (only if it is one) */
+        json* structured() const { return m_structured; }
+
+        /** @return the value as JSON */
+        json ToJson() const;
+
+        /**
+         * @param value  JSON value
+         * @return whether value is the same as this one (numbers are compared by value whatever their type)
+         */
+        bool Equals(const json& value) const;
+
+        /** @return number of bytes allocated by the value outside of itself */
+        size_t GetHeapSize() const;
+    };
+
+    /**
+     * A property of a thing
+     */
+    struct PROPERTY {
+        /** interned name */
+        uint32_t id;
+        /** value */
+        VALUE value;
+    };
+
+    /**
+     * A thing, an object of properties (or a plain value for the rare top level keys that are not objects)
+     */
+    struct THING {
+        /** interned name */
+        uint32_t id;
+        /** whether the thing is an object of properties (value is used otherwise) */
+        bool is_object;
+        /** properties, sorted by id */
+        std::vector<PROPERTY> properties;
+        /** value of the thing if it is not an object */
+        VALUE value;
+        /** version of the store when the thing last changed */
+        uint64_t version;
+    };
+
+private:
+    /** things, sorted by id */
+    std::vector<THING> m_things;
+    /** version of the store, incremented by every merge that changes it */
+    uint64_t m_version;
+
+    /** the versions of the stores created from now on start above it */
+    static std::atomic<uint64_t> m_min_version;
+
+    /** protects the interned names */
+    static std::shared_timed_mutex m_names_mutex;
+    /** name -> id map of the interned names */
+    static std::unordered_map<std::string, uint32_t> m_name_ids;
+    /** interned names, indexed by id (a deque keeps the references stable) */
+    static std::deque<std::string> m_names;
+
+    /**
+     * (THREAD SAFE) Interns a name
+     * @param name  Thing or property name
+     * @return id of the name
+     */
+    static uint32_t __intern(const std::string& name);
+
+    /**
+     * (THREAD SAFE) Looks up the id of a name without interning it
+     * @param name  Thing or property name
+     * @param id    Set to the id of the name if it is interned
+     * @return whether the name is interned
+     */
+    static bool __findId(const std::string& name, uint32_t* id);
+
+    /**
+     * @param id  Interned thing name
+     * @return the thing (nullptr if there is none)
+     */
+    const THING* __findThing(uint32_t id) const;
+
+    /**
+     * @param id      Interned thing name
+     * @param is_new  Set to whether the thing was inserted
+     * @return the thing, inserted if there was none
+     */
+    THING& __getThing(uint32_t id, bool* is_new);
+
+    /**
+     * Merges a value into another (objects are merged recursively, anything else is replaced if it differs)
+     * @param base      Value to merge into
+     * @param new_data  Value to merge
+     * @param delta     If not nullptr, set to what changed (only if anything did)
+     * @return true if anything changed, false otherwise
+     */
+    static bool __mergeValue(VALUE& base, const json& new_data, json* delta);
+
+    /**
+     * Merges an object of properties into a thing
+     * @param thing     Thing to merge into
+     * @param new_data  Properties to merge (type must be OBJECT)
+     * @param delta     If not nullptr, the changed properties are added to it (type must be OBJECT)
+     * @return true if anything changed, false otherwise
+     */
+    static bool __mergeProperties(THING& thing, const json& new_data, json* delta);
+
+    /**
+     * @param thing  A thing (caller must hold m_names_mutex)
+     * @return the thing as JSON
+     */
+    static json __thingToJson(const THING& thing);
+
+    /**
+     * (THREAD SAFE) @return the initial version of a new store
+     */
+    static uint64_t __getInitialVersion();
+
+public:
+    StateStore();
+
+    /**
+     * Merges a message from a middleware into the store (its top level keys are things)
+     * @param new_data  Data to merge (type must be OBJECT, ignored otherwise)
+     * @param delta     If not nullptr, set to the subset of new_data that changed the store (an
+     *                  empty object if nothing did)
+     * @return true if anything changed, false otherwise
+     */
+    bool Merge(const json& new_data, json* delta = nullptr);
+
+    /**
+     * @return the whole store as a JSON object (the blueprint)
+     */
+    json ToJson() const;
+
+    /**
+     * @param thing_id  Name of a thing
+     * @return the state of the thing as JSON (null if there is no such thing)
+     */
+    json GetThing(const std::string& thing_id) const;
+
+    /**
+     * Serializes the state of a thing
+     * @param thing_id  Name of a thing
+     * @param state     Set to the state of the thing serialized as JSON
+     * @param version   Set to the version of the store when the thing last changed
+     * @return whether there is such a thing
+     */
+    bool DumpThing(const std::string& thing_id, std::string* state, uint64_t* version) const;
+
+    /**
+     * @return the names of all the things
+     */
+    std::vector<std::string> GetThingIds() const;
+
+    /**
+     * @return the current version of the store
+     */
+    uint64_t GetVersion() const;
+
+    /**
+     * Adds serialized members to a serialized JSON object (e.g. routing fields to a serialized state)
+     * @param object  Serialized JSON object
+     * @param fields  Serialized members to add, each preceded by a comma
+     * @return the object with the fields before its closing brace (empty if object is not an object)
+     */
+    static std::string SpliceFields(const std::string& object, const std::string& fields);
+
+    /**
+     * (THREAD SAFE) Makes the versions of the stores created from now on above a version
+     * @param version  Highest version issued before (e.g. persisted before a restart)
+     */
+    static void SetMinVersion(uint64_t version);
+
+    /**
+     * Empties the store (the version is kept)
+     */
+    void Clear();
+
+    /**
+     * @return number of bytes used by the store (its containers and values, excluding the shared
+     *         interned names)
+     */
+    size_t GetMemoryUsage() const;
+};
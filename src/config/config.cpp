@@ -28,9 +28,20 @@ int ConfigManager::LoadFromCommandline(int argc, char* argv[]) {
         ("ssl-key,K", po::value<std::string>()->default_value(""), "Path to a file containing the SSL key")
         ("ssl-cert,C", po::value<std::string>()->default_value(""), "Path to a file containing the SSL certificate")
         ("credentials-file,c", po::value<std::string>()->default_value(""), "Path to a file containing credentials for the aggregator clients. The file must be formatted such that each two lines are one for the client 'key' (name:ip:port) and one for the token")
+        ("known-devices-file", po::value<std::string>()->default_value(""), "Path to a file in which the discovered middlewares are persisted, so that they are connected right after a restart (discovery then only picks up changes)")
+        ("cache-snapshot-file", po::value<std::string>()->default_value(""), "Path to a file in which the room caches are persisted, so that they are available right after a restart (until the rooms reconnect)")
         ("credentials-password,P", po::value<std::string>()->default_value(""), "Password used to authenticate with middlewares.")
         ("http-protocol,H", po::value<std::string>()->default_value("https"), "Either http or https")
         ("ws-protocol,W", po::value<std::string>()->default_value("wss"), "Either ws or wss")
+        ("event-backend", po::value<std::string>()->default_value("epoll"), "Event loop backend of the socket cluster: epoll, select or io_uring (Linux 6.0+, falls back to epoll if unsupported)")
+        ("reactor-threads", po::value<int>()->default_value(0), "Number of socket cluster reactor threads (0 uses one per core)")
+        ("connect-timeout", po::value<int>()->default_value(5000), "Time (ms) allowed for connecting to a middleware")
+        ("handshake-timeout", po::value<int>()->default_value(10000), "Time (ms) allowed for the SSL handshake with a middleware")
+        ("max-pending-connects", po::value<int>()->default_value(128), "Maximum number of middleware connections being established at the same time")
+        ("middleware-codecs", po::value<std::vector<std::string>>()->multitoken()->default_value(std::vector<std::string>{"json"}), "Codecs offered to the middlewares during authentication, by preference (json, cbor or msgpack)")
+        ("receive-idle-timeout", po::value<int>()->default_value(3 * 8000), "Time (ms) without receiving anything from a middleware after which it is considered dead (0 to disable)")
+        ("output-soft-watermark", po::value<int>()->default_value(64 * 1024), "Output buffered for a middleware (bytes) above which heartbeats are dropped and state commands for the same thing are coalesced")
+        ("output-hard-watermark", po::value<int>()->default_value(1024 * 1024), "Output buffered for a middleware (bytes) above which the connection is closed")
     ;
 
     try {
@@ -9,52 +9,60 @@
 #include <string.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
 #include <vector>
 
+/** Serial given to the next created client (0 is reserved for the reactor wakeup fd) */
+static std::atomic<uint32_t> g_next_client_serial(1);
+
+/** Bits of an io_uring user_data holding the request (the rest is the SocketClient*) */
+#define URING_REQUEST_MASK 7
+static_assert(alignof(SocketClient) > URING_REQUEST_MASK, "SocketClient pointers must leave room for the io_uring request");
+
 /*******************************************************************************************
  * CLIENT
  *******************************************************************************************/
 
 int SocketClient::__openConnection(std::string ip, int port) {
-    /* Create a socket point */
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    /* Create a socket point (connected later by the cluster) */
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
-    if (sockfd < 0) {
+    if (sockfd < 0)
         LOG(error) << "Failed to create socket FD to (" << ip << ", " << port << ")";
-        return sockfd;
-    }
 
+    return sockfd;
+}
+
+int SocketClient::__startConnecting() {
     struct sockaddr_in serv_addr;
     bzero((char *) &serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = inet_addr(ip.c_str());
-    serv_addr.sin_port = htons(port);
+    serv_addr.sin_addr.s_addr = inet_addr(m_ip.c_str());
+    serv_addr.sin_port = htons(m_port);
 
-    /* Now connect to the server */
-    if (connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        LOG(error) << "Failed to connect to (" << ip << ", " << port << ")";
-        close(sockfd);
+    /* Now connect to the server (completion is reported by the socket becoming writable) */
+    if (connect(m_client_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0 && errno != EINPROGRESS) {
+        LOG(error) << "Failed to connect to (" << m_ip << ", " << m_port << ") (errno=" << errno << ")";
         return -1;
     }
 
-    return sockfd;
+    return 0;
 }
 
-SocketClient::SocketClient(int fd, DISCOVERED_DEVICE device) : m_client_fd(fd), m_ip(device.ip), m_port(device.port), m_identifier(device.name) {
+SocketClient::SocketClient(int fd, DISCOVERED_DEVICE device) : m_client_fd(fd), m_state(CLIENT_PENDING), m_handshake_wants_write(false), m_connect_timer(nullptr), m_holds_connect_slot(false), m_serial(g_next_client_serial++), m_is_write_armed(false), m_is_dirty(false), m_reactor(nullptr), m_outbox(nullptr), m_write_offset(0), m_segments_in_flight(0), m_write_queue_start(0), m_queued_barrier(0), m_uring_requests(0), m_buffered_bytes(0), m_queued_bytes(0), m_is_overloaded(false), m_last_outbound_time(__get_monotonic_time_ms().count()), m_last_inbound_time(__get_monotonic_time_ms().count()), m_bytes_received(0), m_bytes_sent(0), m_frames_received(0), m_frames_sent(0), m_parse_failures(0), m_codec(CODEC_JSON), m_ssl_write_staging_size(0), m_read_start(0), m_read_end(0), m_ip(device.ip), m_port(device.port), m_identifier(device.name) {
     bool requires_ssl = SocketCluster::DeviceRequiresSecureConnection(device);
     m_ssl = nullptr;
     if (SocketCluster::m_ssl_context && requires_ssl) {
+        // the handshake is driven by the reactor once the socket is connected
         m_ssl = SSL_new(SocketCluster::m_ssl_context);
         SSL_set_fd(m_ssl, fd);
-        if (SSL_connect(m_ssl) == -1) {
-            LOG(error) << "Failed to connect SSL socket";
-            SSL_shutdown(m_ssl);
-            SSL_free(m_ssl);
-            m_ssl = nullptr;
-        }
     } else if (requires_ssl) {
         LOG(warning) << "Attempting to connect to SSL client " << device.name << " but no SSL key/cert available";
     }
@@ -62,97 +70,474 @@ SocketClient::SocketClient(int fd, DISCOVERED_DEVICE device) : m_client_fd(fd),
 
 SocketClient::~SocketClient() {
     if (m_ssl) {
-        SSL_shutdown(m_ssl);
+        if (m_state == CLIENT_CONNECTED)
+            SSL_shutdown(m_ssl);
         SSL_free(m_ssl);
     }
     if (m_client_fd > 0)
         close(m_client_fd);
     m_client_fd = -1;
+
+    OUTBOX_NODE* node = m_outbox.exchange(nullptr);
+    while (node) {
+        OUTBOX_NODE* next = node->next;
+        delete node;
+        node = next;
+    }
 }
 
-bool SocketClient::OnReadingAvailable() {
-    uint8_t tmp_buf[4096];
-    int rbytes =
-        m_ssl ? __robust_SSL_read(m_ssl, tmp_buf, 4096)
-              : __robust_read(m_client_fd, tmp_buf, 4096);
-    if (rbytes <= 0) {
-        LOG(info) << "Client " << m_ip << " (fd " << m_client_fd << ") closed the cnnection";
-        return false;
-    } else {
-        m_read_buffer.insert(std::end(m_read_buffer), tmp_buf, tmp_buf + rbytes);
-        while (m_read_buffer.size() >= 4) {
-            size_t payload_size =
-                ((((size_t)m_read_buffer[0]) & 0xFF)      ) |
-                ((((size_t)m_read_buffer[1]) & 0xFF) << 8 ) |
-                ((((size_t)m_read_buffer[2]) & 0xFF) << 16) |
-                ((((size_t)m_read_buffer[3]) & 0xFF) << 24);
-            if (payload_size > 0xFFFFFF) // fuck off.
-                return false;
-            if (m_read_buffer.size() >= 4 + payload_size) {
-                // create a buffer containing the JSON message
-                char* s = new char[payload_size+1];
-                memcpy(s, &m_read_buffer[4], payload_size);
-                s[payload_size] = 0;
-                m_read_buffer.erase(m_read_buffer.begin(), m_read_buffer.begin() + 4 + payload_size);
-                json j;
-                try {
-                    j = json::parse(s);
-                    if (j.is_null())
-                        throw;
-                } catch (...) {
-                    LOG(warning) << "Client " << m_ip << " sent invalid JSON " << s;
-                }
-                delete[] s;
-                if (j.is_null() || !OnMessage(j)) {
-                    LOG(warning) << "Client " << m_ip << " (fd " << m_client_fd << ") communication failure";
-                    return false;
-                }
-            } else
-                break;
+uint64_t SocketClient::__getEpollTag() const {
+    return (((uint64_t)m_serial) << 32) | (uint32_t)m_client_fd;
+}
+
+void SocketClient::__reserveReadSpace(size_t min_space) {
+    if (m_read_buffer.capacity() - m_read_end >= min_space)
+        return;
+
+    if (m_read_start > 0) {
+        // compacting may be enough (only the bytes of one partial frame are moved)
+        size_t unparsed = m_read_end - m_read_start;
+        memmove(m_read_buffer.data(), m_read_buffer.data() + m_read_start, unparsed);
+        m_read_start = 0;
+        m_read_end = unparsed;
+    }
+    // otherwise a buffer of a bigger size class is taken from the pool
+    m_read_buffer.Reserve(m_read_end + min_space, m_read_end);
+}
+
+void SocketClient::__releaseBuffers() {
+    m_read_buffer.Release();
+    m_read_start = m_read_end = 0;
+    m_ssl_write_staging.Release();
+    m_buffered_bytes -= m_ssl_write_staging_size;
+    m_queued_bytes -= m_ssl_write_staging_size;
+    m_ssl_write_staging_size = 0;
+}
+
+bool SocketClient::__parseReadFrames() {
+    while (m_read_end - m_read_start >= 4) {
+        const uint8_t* frame = m_read_buffer.data() + m_read_start;
+        size_t payload_size =
+            ((((size_t)frame[0]) & 0xFF)      ) |
+            ((((size_t)frame[1]) & 0xFF) << 8 ) |
+            ((((size_t)frame[2]) & 0xFF) << 16) |
+            ((((size_t)frame[3]) & 0xFF) << 24);
+        if (payload_size > 0xFFFFFF) { // fuck off.
+            m_parse_failures++;
+            return false;
+        }
+        if (m_read_end - m_read_start < 4 + payload_size) {
+            // make sure the rest of the frame fits without compacting again
+            __reserveReadSpace(4 + payload_size - (m_read_end - m_read_start));
+            break;
+        }
+
+        // decode the message directly from the received bytes (whatever codec it uses)
+        const uint8_t* payload = frame + 4;
+        m_read_start += 4 + payload_size;
+        m_frames_received++;
+        json j;
+        if (__decode_message(payload, payload_size, j) != 0) {
+            m_parse_failures++;
+            LOG(warning) << "Client " << m_ip << " sent an invalid " << __codec_name(__detect_codec(payload, payload_size)) << " message of " << payload_size << " bytes";
+        }
+        if (j.is_null() || !OnMessage(std::move(j))) {
+            LOG(warning) << "Client " << m_ip << " (fd " << m_client_fd << ") communication failure";
+            return false;
         }
     }
 
+    if (m_read_start == m_read_end) {
+        // everything parsed, idle clients hold no buffer
+        m_read_start = m_read_end = 0;
+        m_read_buffer.Release();
+    }
+
+    return true;
+}
+
+bool SocketClient::OnReadingAvailable() {
+    do {
+        __reserveReadSpace(READ_CHUNK_SIZE);
+        size_t space = m_read_buffer.capacity() - m_read_end;
+        int rbytes;
+        if (m_ssl) {
+            ERR_clear_error();
+            rbytes = __robust_SSL_read(m_ssl, m_read_buffer.data() + m_read_end, (int)space);
+            if (rbytes <= 0) {
+                int error = SSL_get_error(m_ssl, rbytes);
+                if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+                    break; // incomplete TLS record (or renegotiation), wait for more bytes
+            }
+        } else {
+            rbytes = __robust_read(m_client_fd, m_read_buffer.data() + m_read_end, space);
+            if (rbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break; // spurious wakeup
+        }
+        if (rbytes <= 0) {
+            LOG(info) << "Client " << m_ip << " (fd " << m_client_fd << ") closed the cnnection";
+            return false;
+        }
+
+        m_read_end += rbytes;
+        m_bytes_received += rbytes;
+        m_last_inbound_time = __get_monotonic_time_ms().count();
+        if (!__parseReadFrames())
+            return false;
+        // records already decrypted by OpenSSL will not make the socket readable again
+    } while (m_ssl && SSL_pending(m_ssl) > 0);
+
+    if (m_read_end == 0)
+        m_read_buffer.Release(); // nothing was received
     return true;
 }
 
+bool SocketClient::__onBytesReceived(const uint8_t* data, size_t size) {
+    __reserveReadSpace(size);
+    memcpy(m_read_buffer.data() + m_read_end, data, size);
+    m_read_end += size;
+    m_bytes_received += size;
+    m_last_inbound_time = __get_monotonic_time_ms().count();
+    return __parseReadFrames();
+}
+
+int SocketClient::__fillWriteVector(struct iovec* iov, size_t* num_segments) {
+    int iovcnt = 0;
+    *num_segments = 0;
+
+    size_t skip = m_write_offset;
+    // every segment takes up to 2 buffers (header and payload)
+    for (auto it = m_write_queue.begin(); it != m_write_queue.end() && iovcnt + 2 <= WRITEV_MAX_SEGMENTS * 2; it++) {
+        (*num_segments)++;
+        if (skip < sizeof(it->header)) {
+            iov[iovcnt].iov_base = (void*)(it->header + skip);
+            iov[iovcnt].iov_len = sizeof(it->header) - skip;
+            iovcnt++;
+            skip = 0;
+        } else
+            skip -= sizeof(it->header);
+        if (it->payload.size() > skip) {
+            iov[iovcnt].iov_base = (void*)(it->payload.data() + skip);
+            iov[iovcnt].iov_len = it->payload.size() - skip;
+            iovcnt++;
+        }
+        skip = 0;
+    }
+
+    return iovcnt;
+}
+
+int SocketClient::__writeQueuedSegments() {
+    struct iovec iov[WRITEV_MAX_SEGMENTS * 2];
+    size_t num_segments;
+    int iovcnt = __fillWriteVector(iov, &num_segments);
+    if (iovcnt == 0)
+        return 0;
+    int wbytes = __robust_writev(m_client_fd, iov, iovcnt);
+    if (wbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0; // socket buffer is full, wait for the next writable event
+    return wbytes;
+}
+
+int SocketClient::__writeQueuedSegmentsSSL() {
+    // a failed SSL_write() must be retried with the same bytes, so the staging buffer is only
+    // refilled once it was fully written
+    if (m_ssl_write_staging_size == 0 && m_write_queue.size() > 0) {
+        m_ssl_write_staging.Reserve(SSL_WRITE_RECORD_SIZE, 0);
+        uint8_t* staging = m_ssl_write_staging.data();
+        while (m_write_queue.size() > 0 && m_ssl_write_staging_size < SSL_WRITE_RECORD_SIZE) {
+            OUTPUT_SEGMENT& segment = m_write_queue.front();
+            size_t take = std::min(segment.size() - m_write_offset, SSL_WRITE_RECORD_SIZE - m_ssl_write_staging_size);
+            if (m_write_offset < sizeof(segment.header)) {
+                size_t header_bytes = std::min(take, sizeof(segment.header) - m_write_offset);
+                memcpy(staging + m_ssl_write_staging_size, segment.header + m_write_offset, header_bytes);
+                m_ssl_write_staging_size += header_bytes;
+                m_write_offset += header_bytes;
+                take -= header_bytes;
+            }
+            memcpy(staging + m_ssl_write_staging_size, segment.payload.data() + (m_write_offset - sizeof(segment.header)), take);
+            m_ssl_write_staging_size += take;
+            m_write_offset += take;
+            if (m_write_offset == segment.size()) {
+                __popWriteQueue(); // handed to OpenSSL with the staging buffer
+                m_write_offset = 0;
+            }
+        }
+    }
+
+    if (m_ssl_write_staging_size == 0)
+        return 0;
+    ERR_clear_error();
+    int wbytes = __robust_SSL_write(m_ssl, m_ssl_write_staging.data(), m_ssl_write_staging_size);
+    if (wbytes > 0) {
+        m_ssl_write_staging_size -= wbytes;
+        memmove(m_ssl_write_staging.data(), m_ssl_write_staging.data() + wbytes, m_ssl_write_staging_size);
+        if (m_ssl_write_staging_size == 0)
+            m_ssl_write_staging.Release(); // idle clients hold no buffer
+        m_buffered_bytes -= wbytes;
+        m_queued_bytes -= wbytes;
+        m_bytes_sent += wbytes;
+        m_last_outbound_time = __get_monotonic_time_ms().count();
+    } else {
+        int error = SSL_get_error(m_ssl, wbytes);
+        if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ)
+            return 0; // retried with the same staging buffer on the next writable event
+    }
+    return wbytes;
+}
+
 bool SocketClient::OnWritingAvailable() {
-    m_write_buffer_mutex.lock();
-    std::vector<uint8_t> staging_buffer (m_write_buffer);
-    m_write_buffer_mutex.unlock();
-    int wbytes =
-        m_ssl ? __robust_SSL_write(m_ssl, &staging_buffer[0], staging_buffer.size())
-              : __robust_write(m_client_fd, &staging_buffer[0], staging_buffer.size());
-    if (wbytes <= 0) {
+    if (!__drainOutbox())
+        return true; // already deregistered
+    int wbytes = m_ssl ? __writeQueuedSegmentsSSL() : __writeQueuedSegments();
+    if (wbytes < 0) {
         LOG(warning) << "Failed to write to client " << m_ip << " (fd " << m_client_fd << ")";
         return false;
-    } else {
-        m_write_buffer_mutex.lock();
-        m_write_buffer.erase(m_write_buffer.begin(), m_write_buffer.begin() + wbytes);
-        m_write_buffer_mutex.unlock();
     }
 
+    if (!m_ssl)
+        __onSegmentsWritten((size_t)wbytes);
+    // segments pushed to the outbox since the drain mark the client dirty, which re-arms it
+    if (m_write_queue.size() == 0 && m_ssl_write_staging_size == 0)
+        SocketCluster::__setClientWriteInterest(this, false);
+
     return true;
 }
 
-void SocketClient::Write(json msg) {
-    std::string dump = msg.dump();
-    const char* cstr = dump.c_str();
-    size_t payload_size = strlen(cstr);
-    m_write_buffer_mutex.lock();
-    m_write_buffer.push_back((uint8_t)((payload_size      ) & 0xFF));
-    m_write_buffer.push_back((uint8_t)((payload_size >> 8 ) & 0xFF));
-    m_write_buffer.push_back((uint8_t)((payload_size >> 16) & 0xFF));
-    m_write_buffer.push_back((uint8_t)((payload_size >> 24) & 0xFF));
-    m_write_buffer.insert(std::end(m_write_buffer), cstr, cstr + payload_size);
-    m_write_buffer_mutex.unlock();
+void SocketClient::__onSegmentsWritten(size_t wbytes) {
+    // drop the fully written segments and remember how far into the next one we got
+    size_t written = wbytes + m_write_offset;
+    while (m_write_queue.size() > 0 && written >= m_write_queue.front().size()) {
+        written -= m_write_queue.front().size();
+        __popWriteQueue();
+    }
+    m_write_offset = written;
+    m_buffered_bytes -= wbytes;
+    m_queued_bytes -= wbytes;
+    m_bytes_sent += wbytes;
+    if (wbytes > 0)
+        m_last_outbound_time = __get_monotonic_time_ms().count();
+}
 
-    SocketCluster::Notify();
+void SocketClient::__pushWriteQueue(OUTPUT_SEGMENT&& segment) {
+    uint64_t position = m_write_queue_start + m_write_queue.size();
+    if (segment.thing.size() > 0)
+        m_queued_state_commands[segment.thing] = position;
+    else
+        m_queued_barrier = position + 1;
+    m_queued_bytes += segment.size();
+    m_write_queue.push_back(std::move(segment));
+}
 
-    if (msg.size() > 0)
+void SocketClient::__popWriteQueue() {
+    const OUTPUT_SEGMENT& segment = m_write_queue.front();
+    if (segment.thing.size() > 0) {
+        auto it = m_queued_state_commands.find(segment.thing);
+        if (it != m_queued_state_commands.end() && it->second == m_write_queue_start)
+            m_queued_state_commands.erase(it);
+    }
+    m_write_queue.pop_front();
+    m_write_queue_start++;
+    m_frames_sent++;
+}
+
+void SocketClient::OUTPUT_SEGMENT::set_payload(std::string data) {
+    payload = std::move(data);
+    size_t payload_size = payload.size();
+    header[0] = (uint8_t)((payload_size      ) & 0xFF);
+    header[1] = (uint8_t)((payload_size >> 8 ) & 0xFF);
+    header[2] = (uint8_t)((payload_size >> 16) & 0xFF);
+    header[3] = (uint8_t)((payload_size >> 24) & 0xFF);
+}
+
+bool SocketClient::__coalesceStateCommand(const OUTPUT_SEGMENT& segment, std::unordered_map<size_t, json>& merged) {
+    auto queued_it = m_queued_state_commands.find(segment.thing);
+    if (queued_it == m_queued_state_commands.end() || queued_it->second < m_queued_barrier)
+        return false;
+    // a partially written segment (or one an io_uring write is reading) must stay untouched
+    size_t first_modifiable = std::max(m_segments_in_flight, (size_t)(m_write_offset > 0 ? 1 : 0));
+    size_t index = (size_t)(queued_it->second - m_write_queue_start);
+    if (index < first_modifiable)
+        return false;
+
+    json msg;
+    if (__decode_message((const uint8_t*)segment.payload.data(), segment.payload.size(), msg) != 0)
+        return false;
+    auto merged_it = merged.find(index);
+    if (merged_it == merged.end()) {
+        const OUTPUT_SEGMENT& queued = m_write_queue[index];
+        json queued_msg;
+        if (__decode_message((const uint8_t*)queued.payload.data(), queued.payload.size(), queued_msg) != 0)
+            return false;
+        merged_it = merged.insert(std::make_pair(index, std::move(queued_msg))).first;
+    }
+    for (auto it = msg.begin(); it != msg.end(); it++)
+        merged_it->second[it.key()] = it.value();
+
+    m_buffered_bytes -= segment.size();
+    return true;
+}
+
+const SocketClient::OUTPUT_SEGMENT SocketClient::m_heartbeat_segments[NUM_MESSAGE_CODECS] = {
+    SocketClient::__makeHeartbeatSegment(CODEC_JSON),
+    SocketClient::__makeHeartbeatSegment(CODEC_CBOR),
+    SocketClient::__makeHeartbeatSegment(CODEC_MSGPACK),
+};
+
+SocketClient::OUTPUT_SEGMENT SocketClient::__makeHeartbeatSegment(MESSAGE_CODEC codec) {
+    OUTPUT_SEGMENT segment;
+    segment.set_payload(__encode_message(json::object(), codec));
+    return segment;
+}
+
+bool SocketClient::__queueSegment(OUTPUT_SEGMENT segment, bool is_heartbeat) {
+    size_t segment_size = segment.size();
+    size_t buffered_bytes = m_buffered_bytes;
+    // the middleware is not keeping up: it is obviously alive, and only its latest state matters
+    // (state commands are coalesced by the reactor, which then applies the hard watermark)
+    bool is_over_soft_watermark = buffered_bytes >= SocketCluster::m_output_soft_watermark;
+    bool is_dropped = is_heartbeat && is_over_soft_watermark;
+    if (!is_dropped) {
+        buffered_bytes = m_buffered_bytes.fetch_add(segment_size);
+        bool is_coalescable = is_over_soft_watermark && segment.thing.size() > 0;
+        if (!is_coalescable && buffered_bytes + segment_size > SocketCluster::m_output_hard_watermark) {
+            m_buffered_bytes -= segment_size;
+            __onOverloaded(buffered_bytes);
+            return false;
+        }
+    }
+
+    if (is_dropped)
+        return false;
+
+    OUTBOX_NODE* node = new OUTBOX_NODE;
+    node->segment = std::move(segment);
+    node->next = m_outbox.load(std::memory_order_relaxed);
+    while (!m_outbox.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+        ;
+
+    // only the first write since the reactor picked up this client's output signals the reactor
+    // (clients that are not in a reactor yet are drained once they connect)
+    SocketCluster::Reactor* reactor = m_reactor;
+    if (reactor && !m_is_dirty.exchange(true))
+        reactor->mark_dirty(shared_from_this());
+
+    return true;
+}
+
+void SocketClient::__onOverloaded(size_t buffered_bytes) {
+    if (m_is_overloaded.exchange(true))
+        return;
+    LOG(warning) << "Client " << m_ip << " (fd " << m_client_fd << ") has " << buffered_bytes << " bytes of pending output, disconnecting";
+    SocketCluster::m_num_overload_disconnects++;
+    SocketCluster::DeregisterClient(shared_from_this());
+}
+
+bool SocketClient::__drainOutbox() {
+    // take the whole stack at once (no ABA possible) and restore the write order
+    OUTBOX_NODE* node = m_outbox.exchange(nullptr, std::memory_order_acquire);
+    OUTBOX_NODE* ordered = nullptr;
+    while (node) {
+        OUTBOX_NODE* next = node->next;
+        node->next = ordered;
+        ordered = node;
+        node = next;
+    }
+
+    std::unordered_map<size_t, json> merged;
+    while (ordered) {
+        OUTPUT_SEGMENT& segment = ordered->segment;
+        // only the latest state matters to a middleware that is not keeping up
+        bool is_coalesced = segment.thing.size() > 0 && m_buffered_bytes >= SocketCluster::m_output_soft_watermark && __coalesceStateCommand(segment, merged);
+        if (!is_coalesced)
+            __pushWriteQueue(std::move(segment));
+
+        OUTBOX_NODE* next = ordered->next;
+        delete ordered;
+        ordered = next;
+    }
+
+    // re-encode the commands that were merged into (with the codec they were queued with)
+    for (auto it = merged.begin(); it != merged.end(); it++) {
+        OUTPUT_SEGMENT& queued = m_write_queue[it->first];
+        size_t old_size = queued.size();
+        queued.set_payload(__encode_message(it->second, __detect_codec((const uint8_t*)queued.payload.data(), queued.payload.size())));
+        m_buffered_bytes += queued.size();
+        m_buffered_bytes -= old_size;
+        m_queued_bytes += queued.size();
+        m_queued_bytes -= old_size;
+    }
+
+    // segments pushed since the exchange are not coalesced yet, so only the drained ones count
+    if (m_queued_bytes > SocketCluster::m_output_hard_watermark) {
+        __onOverloaded(m_queued_bytes);
+        return false;
+    }
+    return true;
+}
+
+void SocketClient::Write(const json& msg) {
+    OUTPUT_SEGMENT segment;
+    bool is_heartbeat = msg.is_object() && msg.size() == 0;
+    if (msg.is_object()) {
+        auto thing_it = msg.find("thing");
+        if (thing_it != msg.end() && thing_it->is_string())
+            segment.thing = thing_it->get<std::string>();
+    }
+    segment.set_payload(__encode_message(msg, m_codec));
+
+    if (__queueSegment(std::move(segment), is_heartbeat) && msg.size() > 0)
         LOG(trace) << "Sent message to " << m_ip << ": " << msg;
 }
 
-bool SocketClient::OnMessage(json msg) {
+void SocketClient::WriteHeartbeat() {
+    __queueSegment(m_heartbeat_segments[m_codec], true);
+}
+
+size_t SocketClient::GetBufferedBytes() const {
+    return m_buffered_bytes;
+}
+
+void SocketClient::SetCodec(MESSAGE_CODEC codec) {
+    m_codec = codec;
+}
+
+MESSAGE_CODEC SocketClient::GetCodec() const {
+    return m_codec;
+}
+
+bool SocketClient::IsConnected() const {
+    return m_state == CLIENT_CONNECTED;
+}
+
+milliseconds SocketClient::GetLastOutboundTime() const {
+    return milliseconds(m_last_outbound_time);
+}
+
+milliseconds SocketClient::GetLastInboundTime() const {
+    return milliseconds(m_last_inbound_time);
+}
+
+json SocketClient::GetStats() const {
+    milliseconds now = __get_monotonic_time_ms();
+    json stats;
+    stats["id"] = m_identifier;
+    stats["ip"] = m_ip;
+    stats["fd"] = m_client_fd;
+    stats["connected"] = IsConnected();
+    stats["codec"] = __codec_name(m_codec);
+    stats["bytes_received"] = (uint64_t)m_bytes_received;
+    stats["bytes_sent"] = (uint64_t)m_bytes_sent;
+    stats["frames_received"] = (uint64_t)m_frames_received;
+    stats["frames_sent"] = (uint64_t)m_frames_sent;
+    stats["parse_failures"] = (uint64_t)m_parse_failures;
+    stats["queue_depth"] = GetBufferedBytes();
+    stats["inbound_idle_ms"] = (now - GetLastInboundTime()).count();
+    stats["outbound_idle_ms"] = (now - GetLastOutboundTime()).count();
+    return stats;
+}
+
+bool SocketClient::OnMessage(json&& msg) {
     if (msg.size() > 0)
         LOG(trace) << "Received message from " << m_ip << ": " << msg;
     return true;
@@ -164,98 +549,841 @@ bool SocketClient::OnMessage(json msg) {
 
 SSL_CTX* SocketCluster::m_ssl_context = nullptr;
 bool SocketCluster::m_is_alive = true;
-int SocketCluster::m_event_pipe_read_end = -1;
-int SocketCluster::m_event_pipe_write_end = -1;
-std::shared_timed_mutex SocketCluster::m_clients_mutex;
+SocketCluster::EVENT_BACKEND SocketCluster::m_backend = SocketCluster::BACKEND_EPOLL;
+int SocketCluster::m_max_connects_per_reactor = 1;
+milliseconds SocketCluster::m_connect_timeout = milliseconds(5000);
+milliseconds SocketCluster::m_handshake_timeout = milliseconds(10000);
+milliseconds SocketCluster::m_receive_idle_timeout = milliseconds(0);
+size_t SocketCluster::m_output_soft_watermark = 64 * 1024;
+size_t SocketCluster::m_output_hard_watermark = 1024 * 1024;
+std::atomic<uint64_t> SocketCluster::m_num_overload_disconnects(0);
+std::atomic<bool> SocketCluster::m_is_stats_dump_requested(false);
+std::vector<std::unique_ptr<SocketCluster::Reactor>> SocketCluster::m_reactors;
+std::mutex SocketCluster::m_clients_mutex;
 std::unordered_map<int, SocketClientPtr> SocketCluster::m_clients;
-std::unordered_map<std::string, SocketClientPtr> SocketCluster::m_clients_by_id;
-std::thread SocketCluster::m_server_thread;
+std::shared_ptr<const SocketCluster::CLIENTS_SNAPSHOT> SocketCluster::m_clients_snapshot = std::make_shared<const SocketCluster::CLIENTS_SNAPSHOT>();
+
+SocketCluster::Reactor::Reactor(int idx) : index(idx), epoll_fd(-1), wakeup_fd(-1), is_signalled(false), dirty_clients(nullptr), clients_snapshot(std::make_shared<const std::vector<SocketClientPtr>>()), num_clients(0), connects_in_flight(0), timers(milliseconds(TIMER_RESOLUTION), __get_monotonic_time_ms()) {
+}
+
+int SocketCluster::Reactor::create() {
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+        return -1;
+
+    if (m_backend == BACKEND_EPOLL) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0)
+            return -2;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint64_t)(uint32_t)wakeup_fd; // serial 0 is never given to a client
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) != 0)
+            return -3;
+    } else if (m_backend == BACKEND_IO_URING) {
+        if (ring.Create(IO_URING_ENTRIES, IO_URING_NUM_BUFFERS, READ_CHUNK_SIZE) != 0)
+            return -4;
+        // submitted by the first iteration of the event loop
+        if (ring.PrepPoll(wakeup_fd, POLLIN, true, URING_WAKEUP) != 0)
+            return -5;
+    }
+
+    if (index == 0)
+        schedule_buffer_pool_report(); // the pool is shared by all the reactors
+
+    thread = std::thread(&SocketCluster::Reactor::run, this);
+
+    return 0;
+}
+
+void SocketCluster::Reactor::destroy() {
+    if (thread.joinable())
+        thread.join();
+
+    clients_mutex.lock(); // write (exclusive) lock
+    clients.clear();
+    publish_clients_snapshot();
+    num_clients = 0;
+    clients_mutex.unlock();
+
+    pending_connects_mutex.lock();
+    pending_connects.clear();
+    pending_connects_mutex.unlock();
+    timers.Clear(); // releases the clients held by the timers
+    connects_in_flight = 0;
+
+    ring.Destroy(); // the kernel cancels the requests in progress
+    uring_clients.clear();
+    removed_clients_mutex.lock();
+    removed_clients.clear();
+    removed_clients_mutex.unlock();
+
+    DIRTY_CLIENT* node = dirty_clients.exchange(nullptr);
+    while (node) {
+        DIRTY_CLIENT* next = node->next;
+        delete node;
+        node = next;
+    }
+
+    if (wakeup_fd >= 0)
+        close(wakeup_fd);
+    wakeup_fd = -1;
+
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    epoll_fd = -1;
+}
+
+void SocketCluster::Reactor::notify() {
+    if (is_signalled.exchange(true))
+        return; // the event loop has not woken up since the last signal
+    uint64_t one = 1;
+    __robust_write(wakeup_fd, (uint8_t*)&one, sizeof(one));
+}
+
+void SocketCluster::Reactor::mark_dirty(SocketClientPtr client) {
+    DIRTY_CLIENT* node = new DIRTY_CLIENT;
+    node->client = client;
+    node->next = dirty_clients.load(std::memory_order_relaxed);
+    while (!dirty_clients.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    notify();
+}
+
+void SocketCluster::Reactor::process_wakeup() {
+    // clear the signal before draining so that a concurrent notify() signals again
+    is_signalled = false;
+    uint64_t value;
+    __robust_read(wakeup_fd, (uint8_t*)&value, sizeof(value));
+
+    // take the whole list at once (no ABA possible) and restore the push order
+    DIRTY_CLIENT* node = dirty_clients.exchange(nullptr, std::memory_order_acquire);
+    DIRTY_CLIENT* ordered = nullptr;
+    while (node) {
+        DIRTY_CLIENT* next = node->next;
+        node->next = ordered;
+        ordered = node;
+        node = next;
+    }
+
+    while (ordered) {
+        SocketClient* client = ordered->client.get();
+        // clear the flag first so that writes from now on push the client again
+        client->m_is_dirty = false;
+        if (client->m_reactor == this && client->__drainOutbox()) {
+            // clients that are not connected yet arm their write interest once connected
+            if (client->m_state == SocketClient::CLIENT_CONNECTED && client->m_write_queue.size() > 0)
+                __setClientWriteInterest(client, true);
+        }
+
+        DIRTY_CLIENT* next = ordered->next;
+        delete ordered;
+        ordered = next;
+    }
+
+    recycle_removed();
+
+    if (index == 0 && m_is_stats_dump_requested.exchange(false))
+        LOG(info) << "SocketCluster stats: " << GetStats().dump();
+
+    start_pending_connects();
+}
+
+void SocketCluster::Reactor::start_pending_connects() {
+    while (connects_in_flight < m_max_connects_per_reactor) {
+        pending_connects_mutex.lock();
+        if (pending_connects.size() == 0) {
+            pending_connects_mutex.unlock();
+            break;
+        }
+        SocketClientPtr client = pending_connects.front();
+        pending_connects.pop_front();
+        pending_connects_mutex.unlock();
+
+        if (!get_client_by_tag(client->__getEpollTag()))
+            continue; // deregistered while waiting
+
+        if (client->__startConnecting() != 0) {
+            DeregisterClient(client);
+            continue;
+        }
+
+        if (m_backend == BACKEND_EPOLL) {
+            // the socket becomes writable (or errors) when the connect() completes
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT;
+            ev.data.u64 = client->__getEpollTag();
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->m_client_fd, &ev) != 0) {
+                LOG(error) << "Failed to add client " << client->m_ip << " (fd " << client->m_client_fd << ") to epoll (errno=" << errno << ")";
+                DeregisterClient(client);
+                continue;
+            }
+        }
+
+        if (m_backend == BACKEND_IO_URING) {
+            // the poll completes with the connect(), or is cancelled by the linked timeout
+            uint64_t user_data = uring_hold(client, URING_CONNECT);
+            uint64_t timeout_user_data = uring_hold(client, URING_CONNECT_TIMEOUT);
+            if (ring.PrepPollWithTimeout(client->m_client_fd, POLLOUT, m_connect_timeout, user_data, timeout_user_data) != 0) {
+                LOG(error) << "Failed to queue the connect poll of client " << client->m_ip << " (fd " << client->m_client_fd << ")";
+                uring_release(client.get());
+                uring_release(client.get());
+                DeregisterClient(client);
+                continue;
+            }
+        } else
+            set_connect_deadline(client, m_connect_timeout);
+
+        client->m_state = SocketClient::CLIENT_CONNECTING;
+        client->m_holds_connect_slot = true;
+        connects_in_flight++;
+    }
+}
+
+void SocketCluster::Reactor::set_connect_deadline(SocketClientPtr client, milliseconds timeout) {
+    client->m_connect_timer = timers.Schedule(__get_monotonic_time_ms() + timeout, [this, client]() {
+        client->m_connect_timer = nullptr;
+        expire_connect(client);
+    });
+}
+
+void SocketCluster::Reactor::clear_connect_deadline(SocketClientPtr client) {
+    if (client->m_connect_timer) {
+        timers.Cancel(client->m_connect_timer);
+        client->m_connect_timer = nullptr;
+    }
+}
+
+void SocketCluster::Reactor::release_connect_slot(SocketClientPtr client) {
+    if (!client->m_holds_connect_slot)
+        return;
+    client->m_holds_connect_slot = false;
+    clear_connect_deadline(client);
+    connects_in_flight--;
+}
+
+void SocketCluster::Reactor::finish_connect(SocketClientPtr client) {
+    clear_connect_deadline(client);
+
+    int error = 0;
+    socklen_t error_size = sizeof(error);
+    if (getsockopt(client->m_client_fd, SOL_SOCKET, SO_ERROR, &error, &error_size) != 0 || error != 0) {
+        LOG(warning) << "Failed to connect to client " << client->m_ip << ":" << client->m_port << " (errno=" << error << ")";
+        release_connect_slot(client);
+        DeregisterClient(client);
+        start_pending_connects();
+    } else if (client->m_ssl) {
+        // the connect slot stays taken until the handshake is over
+        client->m_state = SocketClient::CLIENT_HANDSHAKING;
+        set_connect_deadline(client, m_handshake_timeout);
+        continue_handshake(client);
+    } else
+        on_connected(client);
+}
+
+void SocketCluster::Reactor::continue_handshake(SocketClientPtr client) {
+    ERR_clear_error();
+    int ret = SSL_connect(client->m_ssl);
+    if (ret == 1) {
+        clear_connect_deadline(client);
+        on_connected(client);
+        return;
+    }
+
+    int error = SSL_get_error(client->m_ssl, ret);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        // resume once the socket is ready for the next step of the handshake
+        client->m_handshake_wants_write = error == SSL_ERROR_WANT_WRITE;
+        if (m_backend == BACKEND_EPOLL) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = client->m_handshake_wants_write ? EPOLLOUT : EPOLLIN;
+            ev.data.u64 = client->__getEpollTag();
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->m_client_fd, &ev);
+        } else if (m_backend == BACKEND_IO_URING) {
+            // a failed poll is caught by the handshake deadline
+            uint64_t user_data = uring_hold(client, URING_HANDSHAKE);
+            if (ring.PrepPoll(client->m_client_fd, client->m_handshake_wants_write ? POLLOUT : POLLIN, false, user_data) != 0)
+                uring_release(client.get());
+        }
+        return;
+    }
+
+    LOG(error) << "SSL handshake with client " << client->m_ip << ":" << client->m_port << " failed (error " << error << ")";
+    release_connect_slot(client);
+    DeregisterClient(client);
+    start_pending_connects();
+}
+
+void SocketCluster::Reactor::on_connected(SocketClientPtr client) {
+    release_connect_slot(client);
+    client->m_last_inbound_time = __get_monotonic_time_ms().count(); // the receive-idle time starts now
+    client->m_last_outbound_time = client->m_last_inbound_time.load(); // and so does the heartbeat period
+    client->m_state = SocketClient::CLIENT_CONNECTED;
+    LOG(info) << "Connected to client " << client->m_ip << ":" << client->m_port << " (fd " << client->m_client_fd << ")";
+
+    // start sending what was written while connecting
+    if (!client->__drainOutbox()) {
+        start_pending_connects();
+        return;
+    }
+    if (m_backend == BACKEND_IO_URING) {
+        uring_start_reading(client);
+        if (client->m_write_queue.size() > 0)
+            __setClientWriteInterest(client.get(), true);
+    } else {
+        client->m_is_write_armed = client->m_write_queue.size() > 0;
+        if (m_backend == BACKEND_EPOLL) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | (client->m_is_write_armed ? EPOLLOUT : 0);
+            ev.data.u64 = client->__getEpollTag();
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->m_client_fd, &ev);
+        }
+    }
+
+    schedule_activity_check(client);
+    start_pending_connects();
+}
+
+void SocketCluster::Reactor::expire_connect(SocketClientPtr client) {
+    release_connect_slot(client);
+    if (client->m_state == SocketClient::CLIENT_HANDSHAKING)
+        LOG(warning) << "Timed out during SSL handshake with client " << client->m_ip << ":" << client->m_port;
+    else
+        LOG(warning) << "Timed out connecting to client " << client->m_ip << ":" << client->m_port;
+    DeregisterClient(client);
+
+    start_pending_connects();
+}
+
+void SocketCluster::Reactor::schedule_activity_check(SocketClientPtr client) {
+    // writes and reads only update timestamps, the timer catches up with them when it fires
+    milliseconds now = __get_monotonic_time_ms();
+    milliseconds next_check = client->GetLastOutboundTime() + milliseconds(HEARTBEAT_PERIOD);
+    if (next_check <= now)
+        next_check = now + milliseconds(HEARTBEAT_PERIOD); // the heartbeat is still waiting for the socket
+    if (m_receive_idle_timeout.count() > 0)
+        next_check = std::min(next_check, client->GetLastInboundTime() + m_receive_idle_timeout);
+    timers.Schedule(next_check, [this, client]() { check_activity(client); });
+}
+
+void SocketCluster::Reactor::check_activity(SocketClientPtr client) {
+    if (!get_client_by_tag(client->__getEpollTag()))
+        return; // deregistered, let go of the client
+
+    milliseconds now = __get_monotonic_time_ms();
+    milliseconds inbound_idle_time = now - client->GetLastInboundTime();
+    if (m_receive_idle_timeout.count() > 0 && inbound_idle_time >= m_receive_idle_timeout) {
+        LOG(warning) << "Client " << client->m_ip << " (fd " << client->m_client_fd << ") sent nothing for " << inbound_idle_time.count() << "ms, disconnecting";
+        DeregisterClient(client);
+        return;
+    }
+
+    if (now - client->GetLastOutboundTime() >= milliseconds(HEARTBEAT_PERIOD))
+        client->WriteHeartbeat();
+
+    schedule_activity_check(client);
+}
+
+void SocketCluster::Reactor::schedule_buffer_pool_report() {
+    timers.Schedule(__get_monotonic_time_ms() + milliseconds(BUFFER_POOL_REPORT_PERIOD), [this]() {
+        LOG(debug) << "Buffer pool: " << BufferPool::GetStats().dump();
+        schedule_buffer_pool_report();
+    });
+}
+
+int SocketCluster::Reactor::get_next_timeout() {
+    return timers.GetTimeout(__get_monotonic_time_ms());
+}
 
-void SocketCluster::__thread_entry() {
+void SocketCluster::Reactor::run() {
+    if (m_backend == BACKEND_IO_URING)
+        uring_loop();
+    else if (m_backend == BACKEND_EPOLL)
+        epoll_loop();
+    else
+        select_loop();
+
+    LOG(info) << "SocketCluster reactor " << index << " shutting down...";
+}
+
+void SocketCluster::Reactor::epoll_loop() {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (m_is_alive) {
+        int nready = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, get_next_timeout());
+        if (nready < 0) {
+            if (errno != EINTR)
+                LOG(warning) << "epoll_wait failed (errno=" << errno << ")";
+            continue;
+        }
+        microseconds loop_start = __get_monotonic_time_us();
+
+        for (int i = 0; i < nready; i++) {
+            uint32_t ready = events[i].events;
+            if (events[i].data.u64 == (uint64_t)(uint32_t)wakeup_fd) {
+                process_wakeup();
+                continue;
+            }
+
+            SocketClientPtr cl = get_client_by_tag(events[i].data.u64);
+            if (!cl)
+                continue; // deregistered earlier in this batch
+
+            microseconds ready_start = __get_monotonic_time_us();
+            if (cl->m_state == SocketClient::CLIENT_CONNECTING)
+                finish_connect(cl);
+            else if (cl->m_state == SocketClient::CLIENT_HANDSHAKING)
+                continue_handshake(cl);
+            else {
+                // Reading is available (or the peer hung up, in which case the read fails)
+                bool is_alive = !(ready & (EPOLLIN | EPOLLHUP | EPOLLERR)) || cl->OnReadingAvailable();
+                // Writing is available
+                if (is_alive && (ready & EPOLLOUT))
+                    is_alive = cl->OnWritingAvailable();
+                if (!is_alive)
+                    DeregisterClient(cl);
+            }
+            ready_time.Record((__get_monotonic_time_us() - ready_start).count());
+        }
+
+        timers.Advance(__get_monotonic_time_ms());
+        loop_time.Record((__get_monotonic_time_us() - loop_start).count());
+    }
+}
+
+void SocketCluster::Reactor::select_loop() {
     while (m_is_alive) {
         fd_set read_fds, write_fds;
         FD_ZERO(&read_fds);
         FD_ZERO(&write_fds);
 
-        FD_SET(m_event_pipe_read_end, &read_fds);
+        FD_SET(wakeup_fd, &read_fds);
 
-        int maxfd = m_event_pipe_read_end;
+        int maxfd = wakeup_fd;
 
-        std::vector<SocketClientPtr> clients = GetClientsList();
+        SocketClientsListPtr clients = get_clients_list();
 
-        for (auto it = clients.begin(); it != clients.end(); it++) {
+        for (auto it = clients->begin(); it != clients->end(); it++) {
             SocketClientPtr cl = *it;
-            FD_SET(cl->m_client_fd, &read_fds);
-            if (cl->m_write_buffer.size() > 0)
-                FD_SET(cl->m_client_fd, &write_fds);
+            if (cl->m_state == SocketClient::CLIENT_PENDING)
+                continue;
+            if (cl->m_state == SocketClient::CLIENT_HANDSHAKING) {
+                FD_SET(cl->m_client_fd, cl->m_handshake_wants_write ? &write_fds : &read_fds);
+            } else {
+                if (cl->m_state == SocketClient::CLIENT_CONNECTED)
+                    FD_SET(cl->m_client_fd, &read_fds);
+                if (cl->m_is_write_armed || cl->m_state == SocketClient::CLIENT_CONNECTING)
+                    FD_SET(cl->m_client_fd, &write_fds);
+            }
             maxfd = std::max(maxfd, cl->m_client_fd);
         }
 
-        int ret = select(maxfd + 1, &read_fds, &write_fds, NULL, NULL);
+        int timeout_ms = get_next_timeout();
+        struct timeval timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+        int ret = select(maxfd + 1, &read_fds, &write_fds, NULL, timeout_ms < 0 ? NULL : &timeout);
+        microseconds loop_start = __get_monotonic_time_us();
         if (ret > 0) {
-            if (FD_ISSET(m_event_pipe_read_end, &read_fds)) {
-                // clear all (128 is a magic number, put anything...)
-                uint8_t tmp_buf[128];
-                __robust_read(m_event_pipe_read_end, tmp_buf, 128);
-            }
+            if (FD_ISSET(wakeup_fd, &read_fds))
+                process_wakeup();
 
-            for (auto it = clients.begin(); it != clients.end(); it++) {
-                SocketClientPtr cl = *it;
+            for (auto it = clients->begin(); it != clients->end(); it++) {
+                const SocketClientPtr& cl = *it;
                 int clfd = cl->m_client_fd;
-                if (FD_ISSET(clfd, &read_fds)) {
+                bool is_readable = FD_ISSET(clfd, &read_fds);
+                bool is_writable = FD_ISSET(clfd, &write_fds);
+                if (!is_readable && !is_writable)
+                    continue;
+
+                microseconds ready_start = __get_monotonic_time_us();
+                if (cl->m_state == SocketClient::CLIENT_CONNECTING) {
+                    if (is_writable)
+                        finish_connect(cl);
+                } else if (cl->m_state == SocketClient::CLIENT_HANDSHAKING)
+                    continue_handshake(cl);
+                else if (cl->m_state == SocketClient::CLIENT_CONNECTED) {
                     // Reading is available
-                    if (!cl->OnReadingAvailable()) {
-                        DeregisterClient(cl);
-                        continue;
-                    }
-                }
-                if (FD_ISSET(clfd, &write_fds)) {
+                    bool is_alive = !is_readable || cl->OnReadingAvailable();
                     // Writing is available
-                    if (!cl->OnWritingAvailable()) {
+                    if (is_alive && is_writable)
+                        is_alive = cl->OnWritingAvailable();
+                    if (!is_alive)
                         DeregisterClient(cl);
-                        continue;
-                    }
-                }
+                } // otherwise started connecting during this iteration
+                ready_time.Record((__get_monotonic_time_us() - ready_start).count());
             }
-        } else
+        } else if (ret < 0)
             LOG(warning) << "Select failed: " << ret << " (errno=" << errno << ")";
+
+        timers.Advance(__get_monotonic_time_ms());
+        loop_time.Record((__get_monotonic_time_us() - loop_start).count());
+    }
+}
+
+void SocketCluster::Reactor::uring_loop() {
+    IORing::COMPLETION completion;
+
+    while (m_is_alive) {
+        // submits everything queued while serving the previous completions and timers
+        int ret = ring.SubmitAndWait(get_next_timeout());
+        if (ret != 0)
+            LOG(warning) << "io_uring_enter failed (errno=" << -ret << ")";
+
+        microseconds loop_start = __get_monotonic_time_us();
+        while (ring.PopCompletion(&completion)) {
+            microseconds ready_start = __get_monotonic_time_us();
+            uring_complete(completion);
+            ready_time.Record((__get_monotonic_time_us() - ready_start).count());
+        }
+
+        timers.Advance(__get_monotonic_time_ms());
+        loop_time.Record((__get_monotonic_time_us() - loop_start).count());
+    }
+}
+
+void SocketCluster::Reactor::uring_complete(const IORing::COMPLETION& completion) {
+    URING_REQUEST request = (URING_REQUEST)(completion.user_data & URING_REQUEST_MASK);
+    SocketClient* raw_client = (SocketClient*)(uintptr_t)(completion.user_data & ~(uint64_t)URING_REQUEST_MASK);
+    if (!raw_client) {
+        process_wakeup();
+        if (!completion.has_more && ring.PrepPoll(wakeup_fd, POLLIN, true, URING_WAKEUP) != 0)
+            LOG(error) << "Failed to re-arm the wakeup poll of reactor " << index;
+        return;
+    }
+
+    // the client was kept alive for this completion, but may have been deregistered since the request
+    SocketClientPtr client = uring_clients[raw_client];
+    bool is_registered = get_client_by_tag(client->__getEpollTag()) != nullptr;
+
+    switch (request) {
+        case URING_CONNECT:
+            // the linked timeout cancels the poll if the connect() did not complete in time
+            if (is_registered && client->m_state == SocketClient::CLIENT_CONNECTING) {
+                if (completion.result == -ECANCELED)
+                    expire_connect(client);
+                else
+                    finish_connect(client);
+            }
+            break;
+
+        case URING_HANDSHAKE:
+            if (is_registered && client->m_state == SocketClient::CLIENT_HANDSHAKING && completion.result >= 0)
+                continue_handshake(client);
+            break;
+
+        case URING_READ:
+            if (completion.has_buffer) {
+                if (is_registered && !client->__onBytesReceived(ring.GetBuffer(completion.buffer_id), (size_t)completion.result)) {
+                    DeregisterClient(client);
+                    is_registered = false;
+                }
+                ring.RecycleBuffer(completion.buffer_id);
+            } else if (client->m_ssl && completion.result > 0) {
+                // the socket is readable, OpenSSL reads it
+                if (is_registered && !client->OnReadingAvailable()) {
+                    DeregisterClient(client);
+                    is_registered = false;
+                }
+            } else if (is_registered && completion.result != -ENOBUFS) {
+                LOG(info) << "Client " << client->m_ip << " (fd " << client->m_client_fd << ") closed the connection";
+                DeregisterClient(client);
+                is_registered = false;
+            }
+            // TLS polls are one shot, and the kernel stops multishot receives when it runs out of buffers
+            if (is_registered && !completion.has_more)
+                uring_start_reading(client);
+            break;
+
+        case URING_WRITE:
+            if (!client->m_ssl) {
+                client->m_segments_in_flight = 0;
+                client->m_write_iov.Release();
+                if (!is_registered)
+                    break;
+                if (completion.result < 0) {
+                    LOG(warning) << "Failed to write to client " << client->m_ip << " (fd " << client->m_client_fd << ")";
+                    DeregisterClient(client);
+                    break;
+                }
+                client->__onSegmentsWritten((size_t)completion.result);
+                if (!client->__drainOutbox())
+                    break; // already deregistered
+                if (client->m_write_queue.size() > 0)
+                    uring_start_writing(client.get()); // stays armed
+                else
+                    __setClientWriteInterest(client.get(), false);
+            } else if (is_registered) {
+                // the socket is writable, OpenSSL writes it
+                if (!client->OnWritingAvailable())
+                    DeregisterClient(client);
+                else if (client->m_is_write_armed)
+                    uring_start_writing(client.get());
+            }
+            break;
+
+        default:
+            break; // connect timeouts and cancellations need no handling
+    }
+
+    if (!completion.has_more)
+        uring_release(raw_client);
+}
+
+uint64_t SocketCluster::Reactor::uring_hold(SocketClientPtr client, URING_REQUEST request) {
+    if (client->m_uring_requests++ == 0)
+        uring_clients[client.get()] = client;
+    return (uint64_t)(uintptr_t)client.get() | request;
+}
+
+void SocketCluster::Reactor::uring_release(SocketClient* client) {
+    if (--client->m_uring_requests == 0)
+        uring_clients.erase(client); // may destroy the client
+}
+
+void SocketCluster::Reactor::uring_start_reading(SocketClientPtr client) {
+    uint64_t user_data = uring_hold(client, URING_READ);
+    // OpenSSL reads the socket of TLS clients itself, so it is only polled (one shot: re-arming
+    // completes right away if OnReadingAvailable() left bytes in the socket)
+    int ret = client->m_ssl ? ring.PrepPoll(client->m_client_fd, POLLIN, false, user_data) : ring.PrepRecvMultishot(client->m_client_fd, user_data);
+    if (ret != 0) {
+        LOG(error) << "Failed to queue a read of client " << client->m_ip << " (fd " << client->m_client_fd << ")";
+        uring_release(client.get());
+        DeregisterClient(client);
+    }
+}
+
+void SocketCluster::Reactor::uring_start_writing(SocketClient* client) {
+    SocketClientPtr self = client->shared_from_this();
+    // requests of clients deregistered since their last cancellation would never be cancelled
+    if (!get_client_by_tag(client->__getEpollTag())) {
+        client->m_is_write_armed = false;
+        return;
+    }
+
+    uint64_t user_data = uring_hold(self, URING_WRITE);
+    int ret;
+    if (client->m_ssl)
+        ret = ring.PrepPoll(client->m_client_fd, POLLOUT, false, user_data); // OpenSSL writes the socket itself
+    else {
+        // the iovecs and the segments they point to stay untouched until the write completes
+        client->m_write_iov.Reserve(WRITEV_MAX_SEGMENTS * 2 * sizeof(struct iovec), 0);
+        struct iovec* iov = (struct iovec*)client->m_write_iov.data();
+        int iovcnt = client->__fillWriteVector(iov, &client->m_segments_in_flight);
+        ret = ring.PrepWritev(client->m_client_fd, iov, iovcnt, user_data);
+    }
+    if (ret != 0) {
+        LOG(error) << "Failed to queue a write to client " << client->m_ip << " (fd " << client->m_client_fd << ")";
+        client->m_segments_in_flight = 0;
+        client->m_write_iov.Release();
+        uring_release(client);
+        DeregisterClient(self);
+    }
+}
+
+void SocketCluster::Reactor::recycle_removed() {
+    removed_clients_mutex.lock();
+    std::deque<SocketClientPtr> removed;
+    removed.swap(removed_clients);
+    removed_clients_mutex.unlock();
+
+    for (auto it = removed.begin(); it != removed.end(); it++) {
+        SocketClientPtr& client = *it;
+        // the reactor may have added the fd after the client was deregistered (it is still open,
+        // the client is alive), and ENOENT is fine: it was never added
+        if (m_backend == BACKEND_EPOLL && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->m_client_fd, NULL) != 0 && errno != ENOENT)
+            LOG(warning) << "Failed to remove client " << client->m_ip << " (fd " << client->m_client_fd << ") from epoll (errno=" << errno << ")";
+        client->__releaseBuffers();
+        // the completions and events of a deregistered client are ignored, so a connect() or SSL
+        // handshake in progress would never give its slot back (start_pending_connects() follows)
+        release_connect_slot(client);
+        if (m_backend != BACKEND_IO_URING || client->m_uring_requests == 0)
+            continue; // no request in progress
+        if (ring.PrepCancelAll(client->m_client_fd, uring_hold(client, URING_CANCEL)) != 0) {
+            LOG(warning) << "Failed to cancel the requests of client " << client->m_ip << " (fd " << client->m_client_fd << ")";
+            uring_release(client.get());
+        }
+    }
+}
+
+int SocketCluster::Reactor::add_client(SocketClientPtr client) {
+    clients_mutex.lock(); // write (exclusive) lock
+    clients.insert(std::pair<int, SocketClientPtr>(client->m_client_fd, client));
+    publish_clients_snapshot();
+    num_clients++;
+    clients_mutex.unlock();
+
+    client->m_reactor = this;
+
+    // the reactor connects the client (and picks up its pending output) once a connect slot is free
+    pending_connects_mutex.lock();
+    pending_connects.push_back(client);
+    pending_connects_mutex.unlock();
+    notify();
+
+    return 0;
+}
+
+void SocketCluster::Reactor::remove_client(SocketClientPtr client) {
+    clients_mutex.lock(); // write (exclusive) lock
+    auto it = clients.find(client->m_client_fd);
+    bool is_owned = it != clients.end() && it->second == client;
+    if (is_owned) {
+        clients.erase(it);
+        publish_clients_snapshot();
+        num_clients--;
     }
+    clients_mutex.unlock();
+    if (!is_owned)
+        return;
+
+    // only the reactor thread touches the buffers of the client (and its epoll set and ring), it
+    // recycles them when woken up
+    removed_clients_mutex.lock();
+    removed_clients.push_back(client);
+    removed_clients_mutex.unlock();
+    notify();
+}
 
-    LOG(info) << "SocketCluster thread shutting down...";
+SocketClientPtr SocketCluster::Reactor::get_client_by_tag(uint64_t tag) {
+    int fd = (int)(uint32_t)(tag & 0xFFFFFFFF);
+    uint32_t serial = (uint32_t)(tag >> 32);
+    SocketClientPtr client = nullptr;
+    clients_mutex.lock_shared(); // read lock
+    auto it = clients.find(fd);
+    if (it != clients.end() && it->second->m_serial == serial)
+        client = it->second;
+    clients_mutex.unlock_shared();
+    return client;
 }
 
-void SocketCluster::RegisterClient(SocketClientPtr client) {
-    m_clients_mutex.lock(); // write (exclusive) lock
-    LOG(info) << "Registering client " << client->m_ip << " (fd " << client->m_client_fd << ", " << (client->m_ssl ? "using SSL" : "not using SSL") << ")";
+void SocketCluster::Reactor::publish_clients_snapshot() {
+    std::shared_ptr<std::vector<SocketClientPtr>> snapshot = std::make_shared<std::vector<SocketClientPtr>>();
+    snapshot->reserve(clients.size());
+    for (auto it = clients.begin(); it != clients.end(); it++)
+        snapshot->push_back(it->second);
+    std::atomic_store(&clients_snapshot, SocketClientsListPtr(std::move(snapshot)));
+}
+
+SocketClientsListPtr SocketCluster::Reactor::get_clients_list() {
+    return std::atomic_load(&clients_snapshot);
+}
+
+SocketCluster::Reactor* SocketCluster::__pickReactor() {
+    Reactor* best = m_reactors[0].get();
+    for (size_t i = 1; i < m_reactors.size(); i++)
+        if (m_reactors[i]->num_clients < best->num_clients)
+            best = m_reactors[i].get();
+    return best;
+}
+
+void SocketCluster::__setClientWriteInterest(SocketClient* client, bool enabled) {
+    if (client->m_is_write_armed == enabled)
+        return;
+    client->m_is_write_armed = enabled;
+
+    if (m_backend == BACKEND_SELECT)
+        return; // the select loop rebuilds its write FDs from m_is_write_armed
+
+    Reactor* reactor = client->m_reactor;
+    if (m_backend == BACKEND_IO_URING) {
+        // a write (or writability poll) is in progress for as long as the client is armed
+        if (enabled)
+            reactor->uring_start_writing(client);
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (enabled ? EPOLLOUT : 0);
+    ev.data.u64 = client->__getEpollTag();
+    // ENOENT is fine: the client was just deregistered
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, client->m_client_fd, &ev) != 0 && errno != ENOENT)
+        LOG(warning) << "Failed to update epoll events of client " << client->m_ip << " (fd " << client->m_client_fd << ", errno=" << errno << ")";
+}
+
+int SocketCluster::RegisterClient(SocketClientPtr client) {
+    if (m_backend == BACKEND_SELECT && client->m_client_fd >= FD_SETSIZE) {
+        LOG(error) << "Cannot register client " << client->m_ip << " (fd " << client->m_client_fd << "): select backend is limited to FD_SETSIZE=" << FD_SETSIZE;
+        return -1;
+    }
+
+    Reactor* reactor = __pickReactor();
+
+    m_clients_mutex.lock();
+    LOG(info) << "Registering client " << client->m_ip << " (fd " << client->m_client_fd << ", " << (client->m_ssl ? "using SSL" : "not using SSL") << ", reactor " << reactor->index << ")";
     m_clients.insert(std::pair<int, SocketClientPtr>(client->m_client_fd, client));
-    m_clients_by_id.insert(std::pair<std::string, SocketClientPtr>(client->m_identifier, client));
+    __publishClientsSnapshot();
     m_clients_mutex.unlock();
 
-    Notify();
+    if (reactor->add_client(client) != 0) {
+        DeregisterClient(client);
+        return -2;
+    }
+
+    return 0;
 }
 
 void SocketCluster::DeregisterClient(SocketClientPtr client) {
-    m_clients_mutex.lock(); // write (exclusive) lock
+    m_clients_mutex.lock();
     LOG(info) << "Deregistering client " << client->m_ip << " (fd " << client->m_client_fd << ")";
-    if (m_clients.find(client->m_client_fd) != m_clients.end()) {
-        m_clients.erase(client->m_client_fd);
-        m_clients_by_id.erase(client->m_identifier);
+    auto it = m_clients.find(client->m_client_fd);
+    if (it != m_clients.end() && it->second == client) {
+        m_clients.erase(it);
+        __publishClientsSnapshot();
     }
     m_clients_mutex.unlock();
 
-    Notify();
+    Reactor* reactor = client->m_reactor;
+    if (reactor)
+        reactor->remove_client(client);
 }
 
 int SocketCluster::Initialize() {
     m_is_alive = true;
 
-    int pipe_ends[2];
-    if (pipe(pipe_ends) != 0)
-        return -1;
-    m_event_pipe_read_end = pipe_ends[0];
-    m_event_pipe_write_end = pipe_ends[1];
+    std::string backend = ConfigManager::get<std::string>("event-backend");
+    m_backend = BACKEND_EPOLL;
+    if (backend == __backendName(BACKEND_SELECT))
+        m_backend = BACKEND_SELECT;
+    else if (backend == __backendName(BACKEND_IO_URING)) {
+        if (IORing::IsSupported())
+            m_backend = BACKEND_IO_URING;
+        else
+            LOG(warning) << "io_uring is not supported by this kernel (or build), using epoll";
+    } else if (backend != __backendName(BACKEND_EPOLL))
+        LOG(warning) << "Unknown event backend \"" << backend << "\", using epoll";
 
-    m_server_thread = std::thread(SocketCluster::__thread_entry);
+    int num_reactors = ConfigManager::get<int>("reactor-threads");
+    if (num_reactors <= 0)
+        num_reactors = std::max(1, (int)std::thread::hardware_concurrency());
+
+    m_max_connects_per_reactor = std::max(1, ConfigManager::get<int>("max-pending-connects") / num_reactors);
+    m_connect_timeout = milliseconds(ConfigManager::get<int>("connect-timeout"));
+    m_handshake_timeout = milliseconds(ConfigManager::get<int>("handshake-timeout"));
+    m_receive_idle_timeout = milliseconds(ConfigManager::get<int>("receive-idle-timeout"));
+    m_output_soft_watermark = (size_t)std::max(0, ConfigManager::get<int>("output-soft-watermark"));
+    m_output_hard_watermark = (size_t)std::max(0, ConfigManager::get<int>("output-hard-watermark"));
+    if (m_output_hard_watermark < m_output_soft_watermark)
+        LOG(warning) << "output-hard-watermark is below output-soft-watermark, state commands will never be coalesced";
+
+    for (int i = 0; i < num_reactors; i++) {
+        m_reactors.push_back(std::unique_ptr<Reactor>(new Reactor(i)));
+        if (m_reactors[i]->create() != 0) {
+            LOG(error) << "Failed to create SocketCluster reactor " << i;
+            return -1;
+        }
+    }
+    LOG(info) << "SocketCluster using " << num_reactors << " " << __backendName(m_backend) << " reactor(s)";
+
+    // `kill -USR1 <pid>` logs the statistics of the cluster
+    signal(SIGUSR1, &SocketCluster::__onStatsSignal);
 
     // initialize SSL
     SSL_load_error_strings();
@@ -267,6 +1395,8 @@ int SocketCluster::Initialize() {
         m_ssl_context = SSL_CTX_new(TLSv1_2_client_method());
         if (m_ssl_context) {
             SSL_CTX_set_options(m_ssl_context, SSL_OP_SINGLE_DH_USE);
+            // the sockets are non-blocking: a failed SSL_write() is retried once the socket is writable
+            SSL_CTX_set_mode(m_ssl_context, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
             if (ConfigManager::get<std::string>("ssl-key").size() > 0) {
                 LOG(info) << "Using SSL key: " << ConfigManager::get<std::string>("ssl-key");
@@ -299,25 +1429,25 @@ int SocketCluster::Initialize() {
 }
 
 void SocketCluster::WaitForCompletion() {
-    if (m_server_thread.joinable())
-        m_server_thread.join();
+    for (size_t i = 0; i < m_reactors.size(); i++)
+        if (m_reactors[i]->thread.joinable())
+            m_reactors[i]->thread.join();
 }
 
 void SocketCluster::Cleanup() {
     Kill();
     WaitForCompletion();
+    signal(SIGUSR1, SIG_DFL); // the reactors are about to be destroyed
 
-    m_clients_mutex.lock(); // write (exclusive) lock
+    m_clients_mutex.lock();
     m_clients.clear();
-    m_clients_by_id.clear();
+    __publishClientsSnapshot();
     m_clients_mutex.unlock();
 
-    if (m_event_pipe_read_end > 0)
-        close(m_event_pipe_read_end);
-    if (m_event_pipe_write_end > 0)
-        close(m_event_pipe_write_end);
-
-    m_event_pipe_read_end = m_event_pipe_write_end = -1;
+    for (size_t i = 0; i < m_reactors.size(); i++)
+        m_reactors[i]->destroy();
+    m_reactors.clear();
+    LOG(info) << "Buffer pool: " << BufferPool::GetStats().dump();
 
     SSL_CTX_free(m_ssl_context);
     m_ssl_context = nullptr;
@@ -328,8 +1458,8 @@ void SocketCluster::Cleanup() {
 }
 
 void SocketCluster::Notify() {
-    uint8_t buf[1] = {0};
-    __robust_write(m_event_pipe_write_end, buf, 1);
+    for (size_t i = 0; i < m_reactors.size(); i++)
+        m_reactors[i]->notify();
 }
 
 void SocketCluster::Kill() {
@@ -337,29 +1467,102 @@ void SocketCluster::Kill() {
     Notify();
 }
 
+void SocketCluster::__publishClientsSnapshot() {
+    std::shared_ptr<CLIENTS_SNAPSHOT> snapshot = std::make_shared<CLIENTS_SNAPSHOT>();
+    snapshot->clients.reserve(m_clients.size());
+    for (auto it = m_clients.begin(); it != m_clients.end(); it++) {
+        snapshot->clients.push_back(it->second);
+        snapshot->clients_by_id.insert(std::pair<std::string, SocketClientPtr>(it->second->m_identifier, it->second));
+        if (it->second->m_indexed_room_id.size() > 0)
+            snapshot->clients_by_room.insert(std::pair<std::string, SocketClientPtr>(it->second->m_indexed_room_id, it->second));
+    }
+    std::atomic_store(&m_clients_snapshot, std::shared_ptr<const CLIENTS_SNAPSHOT>(std::move(snapshot)));
+}
+
 bool SocketCluster::IsClientRegistered(DISCOVERED_DEVICE device) {
-    m_clients_mutex.lock_shared(); // read lock
-    bool ret = m_clients_by_id.find(device.name) != m_clients_by_id.end();
-    m_clients_mutex.unlock_shared();
-    return ret;
+    std::shared_ptr<const CLIENTS_SNAPSHOT> snapshot = GetClientsSnapshot();
+    return snapshot->clients_by_id.find(device.name) != snapshot->clients_by_id.end();
+}
+
+SocketClientPtr SocketCluster::GetClient(const std::string& id) {
+    std::shared_ptr<const CLIENTS_SNAPSHOT> snapshot = GetClientsSnapshot();
+    auto it = snapshot->clients_by_id.find(id);
+    return it == snapshot->clients_by_id.end() ? nullptr : it->second;
 }
 
-SocketClientPtr SocketCluster::GetClient(std::string id) {
-    m_clients_mutex.lock_shared(); // read lock
-    auto it = m_clients_by_id.find(id);
-    m_clients_mutex.unlock_shared();
-    return it == m_clients_by_id.end() ? nullptr : it->second;
+void SocketCluster::SetClientRoom(SocketClient* client, const std::string& room_id) {
+    m_clients_mutex.lock();
+    if (client->m_indexed_room_id != room_id) {
+        client->m_indexed_room_id = room_id;
+        auto it = m_clients.find(client->m_client_fd);
+        if (it != m_clients.end() && it->second.get() == client) {
+            std::shared_ptr<const CLIENTS_SNAPSHOT> snapshot = GetClientsSnapshot();
+            auto other = snapshot->clients_by_room.find(room_id);
+            if (other != snapshot->clients_by_room.end() && other->second.get() != client)
+                LOG(warning) << "Clients " << other->second->m_ip << " and " << client->m_ip << " both serve room " << room_id;
+            __publishClientsSnapshot();
+        }
+    }
+    m_clients_mutex.unlock();
 }
 
-std::vector<SocketClientPtr> SocketCluster::GetClientsList() {
-    std::vector<SocketClientPtr> clients;
-    m_clients_mutex.lock_shared(); // read lock
-    for (auto it = m_clients.begin(); it != m_clients.end(); it++)
-        clients.push_back(it->second);
-    m_clients_mutex.unlock_shared();
-    return clients;
+SocketClientPtr SocketCluster::GetClientByRoom(const std::string& room_id) {
+    std::shared_ptr<const CLIENTS_SNAPSHOT> snapshot = GetClientsSnapshot();
+    auto it = snapshot->clients_by_room.find(room_id);
+    return it == snapshot->clients_by_room.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<const SocketCluster::CLIENTS_SNAPSHOT> SocketCluster::GetClientsSnapshot() {
+    return std::atomic_load(&m_clients_snapshot);
+}
+
+std::string SocketCluster::__backendName(EVENT_BACKEND backend) {
+    switch (backend) {
+        case BACKEND_SELECT:
+            return "select";
+        case BACKEND_IO_URING:
+            return "io_uring";
+        default:
+            return "epoll";
+    }
 }
 
 bool SocketCluster::DeviceRequiresSecureConnection(DISCOVERED_DEVICE device) {
     return device.type == 8;
 }
+
+uint64_t SocketCluster::GetNumOverloadDisconnects() {
+    return m_num_overload_disconnects;
+}
+
+void SocketCluster::__onStatsSignal(int signum) {
+    // notify() only does an atomic exchange and a write() to the eventfd
+    m_is_stats_dump_requested = true;
+    if (m_reactors.size() > 0)
+        m_reactors[0]->notify();
+}
+
+json SocketCluster::GetStats() {
+    json stats;
+    stats["backend"] = __backendName(m_backend);
+    stats["overload_disconnects"] = GetNumOverloadDisconnects();
+
+    stats["reactors"] = json::array();
+    for (size_t i = 0; i < m_reactors.size(); i++) {
+        Reactor* reactor = m_reactors[i].get();
+        stats["reactors"].push_back({
+            {"index", reactor->index},
+            {"clients", (int)reactor->num_clients},
+            {"loop_time_us", reactor->loop_time.ToJson()},
+            {"ready_time_us", reactor->ready_time.ToJson()},
+        });
+    }
+
+    std::shared_ptr<const CLIENTS_SNAPSHOT> snapshot = GetClientsSnapshot();
+    stats["clients"] = json::array();
+    for (auto it = snapshot->clients.begin(); it != snapshot->clients.end(); it++)
+        stats["clients"].push_back((*it)->GetStats());
+
+    stats["buffer_pool"] = BufferPool::GetStats();
+    return stats;
+}
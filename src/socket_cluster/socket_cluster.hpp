@@ -10,53 +10,340 @@
 #include <json.hpp>
 using json = nlohmann::json;
 
+#include "utilities/time_utilities.hpp"
+#include "utilities/timer_wheel.hpp"
+#include "utilities/message_codec.hpp"
+#include "utilities/io_ring.hpp"
+#include "utilities/buffer_pool.hpp"
+#include "utilities/histogram.hpp"
+
 #include <unordered_map>
+#include <deque>
 #include <thread>
 #include <mutex>
 #include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 typedef std::shared_ptr<class SocketClient> SocketClientPtr;
+typedef std::shared_ptr<const std::vector<SocketClientPtr>> SocketClientsListPtr;
+
+/** Maximum number of ready events retrieved by a single epoll_wait() */
+#define EPOLL_MAX_EVENTS 256
+
+/** Minimum free space in a client's read buffer before each read (bytes) */
+#define READ_CHUNK_SIZE 16384
+
+/** Number of submission entries of each reactor's io_uring */
+#define IO_URING_ENTRIES 1024
+
+/** Number of receive buffers registered by each reactor's io_uring (power of 2, READ_CHUNK_SIZE bytes each) */
+#define IO_URING_NUM_BUFFERS 256
+
+/** Maximum number of queued messages flushed by a single writev() */
+#define WRITEV_MAX_SEGMENTS 64
+
+/** Maximum number of bytes aggregated into a single SSL_write() (size of a TLS record) */
+#define SSL_WRITE_RECORD_SIZE 16384
+
+/** Period for logging the occupancy of the buffer pool (ms) */
+#define BUFFER_POOL_REPORT_PERIOD 60000
+
+/** Resolution of the reactors' timer wheels (ms) */
+#define TIMER_RESOLUTION 10
+
+/** Period for heartbeats (a heartbeat is only sent after this long without writing to a client) */
+#define HEARTBEAT_PERIOD 8000
 
 /**
  * The SocketCluster facilitates the management of SocketClient's by running and
- * maintaining a thread that performs a select loop on the SocketClient's FDs.
+ * maintaining reactor threads that perform an event loop on the SocketClient's FDs.
+ *
+ * The clients are sharded across a configurable number of reactors ("reactor-threads"
+ * config). Every client is owned by exactly one reactor for its whole lifetime, so all
+ * the I/O, framing and OnMessage() calls of a client happen on the same thread in order.
+ * Each reactor has its own wakeup eventfd and its own fd -> client map, while the global
+ * identifier -> client map keeps working across shards.
+ *
+ * The registry is read far more often than it changes (every Verboze command, every select
+ * loop iteration), so readers never lock it nor copy it: RegisterClient() and
+ * DeregisterClient() publish a new immutable snapshot of it (atomically swapped), and
+ * readers keep using the snapshot they loaded for as long as they hold it. The snapshot also
+ * indexes the clients by room id (republished when a client announces its room), so routing a
+ * command to its room is a single lookup.
+ *
+ * Writes never take a lock: every client has a lock-free outbox (a multi-producer single-
+ * consumer stack of framed messages) that only the owning reactor drains into the client's
+ * write queue. Writes are signalled to the reactor through a lock-free list of dirty
+ * clients: the first write after a client's output was picked up pushes the client to the
+ * list, and the first push after the reactor drained the list writes to the eventfd. The
+ * reactor then only visits the dirty clients to drain their outbox and arm their write
+ * interest.
+ *
+ * The read buffers of the clients (and the staging buffers of their TLS and io_uring writes) are
+ * taken from the shared BufferPool when needed and given back as soon as they are drained, so
+ * idle connections hold no buffer memory. The reactor also recycles the buffers of a client
+ * when it is deregistered, even if the client itself lives on.
+ *
+ * Every client counts its traffic (bytes and frames in each direction, undecodable messages)
+ * and every reactor keeps histograms of the duration of its loop iterations and of the time
+ * spent serving each ready client, all with relaxed atomics so they stay on in production.
+ * GetStats() gathers them (with the queue depth and idle times of the clients) as JSON, and
+ * SIGUSR1 makes reactor 0 log them.
+ *
+ * Each reactor also owns a TimerWheel holding the deadlines of its clients (connect and
+ * handshake timeouts, heartbeats, receive-idle checks). The event loop sleeps until the
+ * next timer needs processing, and advances the wheel after serving the ready clients.
+ *
+ * Three backends are available (selected by the "event-backend" config):
+ *
+ * epoll (default):
+ *     - clients are added to the epoll set of their reactor when their connect() starts, and removed by the reactor once they are deregistered
+ *     - EPOLLIN is always watched, EPOLLOUT is only armed while the client's write buffer is non-empty
+ *     - each wakeup only visits the clients that are actually ready
  *
- * The cluster is implemented as follows:
+ * select (fallback):
  * While thread is alive:
- *     - create read FDs (all registered clients + eventfd) and write FDs (all clients that have > 0 write buffers)
+ *     - create read FDs (all clients of the reactor + eventfd) and write FDs (all clients with armed write interest)
  *     - perform a select on the FDs
  *     - after select returns:
  *         - serve any reads or writes to clients
- *         - read the eventfd and discard the value
+ *         - read the eventfd and arm the write interest of the dirty clients
  *
- * When a client fills some data in its write buffer, it must Notify() the SocketCluster
- * so that it breaks out of the select
+ * io_uring (Linux 6.0+, falls back to epoll if unsupported):
+ *     - every reactor owns a ring, all the requests queued while serving completions are submitted
+ *       by the single io_uring_enter() that waits for the next completions
+ *     - plain clients use a multishot receive into buffers registered with the kernel (picked only
+ *       when data arrives) and writev requests, TLS clients use polls (OpenSSL does their I/O)
+ *     - connects are polled with a linked timeout instead of a wheel deadline
+ *     - deregistered clients get their requests cancelled, and are kept alive until the last completion
  */
 class SocketCluster {
     friend class SocketClient;
 
+    /**
+     * Represents a reactor thread and the shard of clients it owns
+     */
+    struct Reactor {
+        /** A node in the lock-free list of clients with pending output */
+        struct DIRTY_CLIENT {
+            /** Client that has pending output */
+            SocketClientPtr client;
+            /** Next node */
+            DIRTY_CLIENT* next;
+        };
+
+        /**
+         * io_uring requests of a client, stored in the low bits of the user_data (next to the
+         * SocketClient*, the wakeup poll has no client)
+         */
+        enum URING_REQUEST {
+            URING_WAKEUP = 0,
+            URING_CONNECT = 1,
+            URING_CONNECT_TIMEOUT = 2,
+            URING_HANDSHAKE = 3,
+            URING_READ = 4,
+            URING_WRITE = 5,
+            URING_CANCEL = 6,
+        };
+
+        /** Index of this reactor in m_reactors */
+        int index;
+        /** epoll instance (only with BACKEND_EPOLL) */
+        int epoll_fd;
+        /** eventfd used to wake up the event loop */
+        int wakeup_fd;
+        /** set when wakeup_fd has been written to and the event loop did not wake up yet */
+        std::atomic<bool> is_signalled;
+        /** head of the lock-free list of clients with pending output */
+        std::atomic<DIRTY_CLIENT*> dirty_clients;
+        /** shared mutex to protect clients */
+        std::shared_timed_mutex clients_mutex;
+        /** fd -> SocketClientPtr map of the clients owned by this reactor */
+        std::unordered_map<int, SocketClientPtr> clients;
+        /** immutable list of the clients owned by this reactor, republished when clients changes (atomic access only) */
+        SocketClientsListPtr clients_snapshot;
+        /** Number of clients owned by this reactor (used to pick the least loaded reactor) */
+        std::atomic<int> num_clients;
+        /** protects pending_connects */
+        std::mutex pending_connects_mutex;
+        /** clients waiting for a connect slot */
+        std::deque<SocketClientPtr> pending_connects;
+        /** number of connect() calls and SSL handshakes in progress (reactor thread only) */
+        int connects_in_flight;
+        /** connect/handshake deadlines, heartbeats and receive-idle checks of the clients (reactor thread only) */
+        TimerWheel timers;
+        /** io_uring instance (only with BACKEND_IO_URING) */
+        IORing ring;
+        /** clients with io_uring requests in progress, kept alive until their last completion (reactor thread only) */
+        std::unordered_map<SocketClient*, SocketClientPtr> uring_clients;
+        /** protects removed_clients */
+        std::mutex removed_clients_mutex;
+        /** deregistered clients whose buffers must be recycled (and io_uring requests cancelled) */
+        std::deque<SocketClientPtr> removed_clients;
+        /** duration (us) of the event loop iterations, from the end of the wait to the end of the timers */
+        Histogram loop_time;
+        /** time (us) spent serving each ready client (or io_uring completion) */
+        Histogram ready_time;
+        /** thread running the event loop */
+        std::thread thread;
+
+        /** Initializes variables */
+        Reactor(int idx);
+
+        /** Creates the eventfd (and epoll/io_uring instance) and starts the thread */
+        int create();
+        /** Joins the thread and frees resources */
+        void destroy();
+        /** (THREAD SAFE) Wakes up the event loop (only signals wakeup_fd if not signalled already) */
+        void notify();
+        /** (THREAD SAFE) Pushes a client to the dirty list and wakes up the event loop */
+        void mark_dirty(SocketClientPtr client);
+        /** Clears the wakeup signal and arms the write interest of all the dirty clients */
+        void process_wakeup();
+        /** Thread entry point */
+        void run();
+        /** Event loop using epoll */
+        void epoll_loop();
+        /** Event loop using select (fallback) */
+        void select_loop();
+        /** Event loop using io_uring */
+        void uring_loop();
+        /** Handles an io_uring completion */
+        void uring_complete(const IORing::COMPLETION& completion);
+        /** @return the user_data of a request of a client, which is kept alive until the request completes */
+        uint64_t uring_hold(SocketClientPtr client, URING_REQUEST request);
+        /** Lets go of a client after the last completion of a request */
+        void uring_release(SocketClient* client);
+        /** Queues the request reading from a connected client (multishot receive, or poll for TLS clients) */
+        void uring_start_reading(SocketClientPtr client);
+        /** Queues a write of the queued output of a connected client (or a writability poll for TLS clients) */
+        void uring_start_writing(SocketClient* client);
+        /** Removes the deregistered clients from the epoll set, recycles their buffers and connect slots (and queues the cancellation of their io_uring requests) */
+        void recycle_removed();
+        /** Logs the occupancy of the buffer pool every BUFFER_POOL_REPORT_PERIOD */
+        void schedule_buffer_pool_report();
+        /** Adds a client to this reactor (and to its epoll set) */
+        int add_client(SocketClientPtr client);
+        /** Removes a client from this reactor, the reactor then removes it from its epoll set and recycles its buffers */
+        void remove_client(SocketClientPtr client);
+        /** Starts connecting pending clients while there are free connect slots */
+        void start_pending_connects();
+        /** Sets the deadline of the connect() (or SSL handshake) of a client */
+        void set_connect_deadline(SocketClientPtr client, milliseconds timeout);
+        /** Cancels the connect() (or SSL handshake) deadline of a client */
+        void clear_connect_deadline(SocketClientPtr client);
+        /** Frees the connect slot of a client (and cancels its deadline), does nothing if it holds none */
+        void release_connect_slot(SocketClientPtr client);
+        /** Completes (or fails) the connect() of a client once its socket is writable */
+        void finish_connect(SocketClientPtr client);
+        /** Advances the SSL handshake of a client, called whenever its socket is ready */
+        void continue_handshake(SocketClientPtr client);
+        /** Frees the connect slot of a client that is ready for traffic and arms its events */
+        void on_connected(SocketClientPtr client);
+        /** Drops a client whose connect() (or SSL handshake) deadline passed */
+        void expire_connect(SocketClientPtr client);
+        /** Schedules the next activity check of a connected client (when it may need a heartbeat or be idle for too long) */
+        void schedule_activity_check(SocketClientPtr client);
+        /** Sends a heartbeat to a client that was not written to for HEARTBEAT_PERIOD, drops it if it sent nothing for m_receive_idle_timeout */
+        void check_activity(SocketClientPtr client);
+        /** @return time (ms) until the next timer needs processing, -1 if there is none */
+        int get_next_timeout();
+        /** Looks up the client that an epoll event was generated for (nullptr if no longer registered) */
+        SocketClientPtr get_client_by_tag(uint64_t tag);
+        /** Republishes clients_snapshot from clients (caller must hold clients_mutex) */
+        void publish_clients_snapshot();
+        /** Returns the latest snapshot of the clients owned by this reactor */
+        SocketClientsListPtr get_clients_list();
+    };
+
+public:
+    /**
+     * Event loop backends
+     */
+    enum EVENT_BACKEND {
+        BACKEND_EPOLL = 0,
+        BACKEND_SELECT = 1,
+        BACKEND_IO_URING = 2,
+    };
+
+    /**
+     * An immutable snapshot of the registered clients
+     */
+    struct CLIENTS_SNAPSHOT {
+        /** registered clients */
+        std::vector<SocketClientPtr> clients;
+        /** identifier -> SocketClientPtr map (same clients as above) */
+        std::unordered_map<std::string, SocketClientPtr> clients_by_id;
+        /** room id -> SocketClientPtr map (clients that announced their room, see SetClientRoom()) */
+        std::unordered_map<std::string, SocketClientPtr> clients_by_room;
+    };
+
+private:
+
     /** SSL context */
     static SSL_CTX* m_ssl_context;
 
-    /** thread runs while true */
+    /** threads run while true */
     static bool m_is_alive;
-    /** used to notify the select */
-    static int m_event_pipe_read_end;
-    /** used to notify the select */
-    static int m_event_pipe_write_end;
-    /** shared mutex to protect m_clients and m_clients_by_ip */
-    static std::shared_timed_mutex m_clients_mutex;
+    /** event loop backend of the reactors */
+    static EVENT_BACKEND m_backend;
+    /** maximum number of connect() calls in progress per reactor */
+    static int m_max_connects_per_reactor;
+    /** time allowed for a connect() to complete */
+    static milliseconds m_connect_timeout;
+    /** time allowed for an SSL handshake to complete */
+    static milliseconds m_handshake_timeout;
+    /** time without receiving from a client after which it is disconnected (0 to disable) */
+    static milliseconds m_receive_idle_timeout;
+    /** buffered output (bytes) of a client above which its output is thinned out */
+    static size_t m_output_soft_watermark;
+    /** buffered output (bytes) of a client above which it is disconnected */
+    static size_t m_output_hard_watermark;
+    /** number of clients disconnected for reaching m_output_hard_watermark */
+    static std::atomic<uint64_t> m_num_overload_disconnects;
+    /** set by SIGUSR1, reactor 0 logs GetStats() when it sees it */
+    static std::atomic<bool> m_is_stats_dump_requested;
+    /** reactors running the event loops */
+    static std::vector<std::unique_ptr<Reactor>> m_reactors;
+    /** mutex to serialize the modifications of m_clients (readers use m_clients_snapshot) */
+    static std::mutex m_clients_mutex;
     /** fd -> SocketClientPtr map */
     static std::unordered_map<int, SocketClientPtr> m_clients;
-    /** identifier -> SocketClientPtr map (same SocketClient* as above) */
-    static std::unordered_map<std::string, SocketClientPtr> m_clients_by_id;
-    /** thread running the select loop */
-    static std::thread m_server_thread;
+    /** latest snapshot of m_clients (atomic access only) */
+    static std::shared_ptr<const CLIENTS_SNAPSHOT> m_clients_snapshot;
+
+    /**
+     * Builds and publishes a new m_clients_snapshot from m_clients. Caller must hold m_clients_mutex.
+     */
+    static void __publishClientsSnapshot();
+
+    /**
+     * Picks the reactor that should own a new client
+     * @return least loaded reactor
+     */
+    static Reactor* __pickReactor();
 
     /**
-     * Entry point of the thread that performs the select on the clients
+     * Arms or disarms the write interest of a client. Must be called from the reactor
+     * owning the client.
+     * @param client   Client to update
+     * @param enabled  Whether or not the client has pending data to write
      */
-    static void __thread_entry();
+    static void __setClientWriteInterest(SocketClient* client, bool enabled);
+
+    /**
+     * @param backend  Event loop backend
+     * @return name of the backend in the "event-backend" config
+     */
+    static std::string __backendName(EVENT_BACKEND backend);
+
+    /**
+     * SIGUSR1 handler, requests reactor 0 to log GetStats() (only does async-signal-safe work)
+     * @param signum  Signal number
+     */
+    static void __onStatsSignal(int signum);
 
 public:
     /**
@@ -66,7 +353,7 @@ public:
     static int Initialize();
 
     /**
-     * Performs a join() on the select thread
+     * Performs a join() on the reactor threads
      */
     static void WaitForCompletion();
 
@@ -76,20 +363,21 @@ public:
     static void Cleanup();
 
     /**
-     * (THREAD SAFE) Notifies the cluster to break out of the select loop to update the FDs
+     * (THREAD SAFE) Notifies all the reactors to break out of their event loop
      */
     static void Notify();
 
     /**
-     * (THREAD SAFE) Kills the select thread
+     * (THREAD SAFE) Kills the reactor threads
      */
     static void Kill();
 
     /**
      * (THREAD SAFE) Registers a SocketClientPtr
      * @param client SocketClientPtr to register
+     * @return 0 on success, negative value on failure
      */
-    static void RegisterClient(SocketClientPtr client);
+    static int RegisterClient(SocketClientPtr client);
 
     /**
      * (THREAD SAFE) Deregisters a SocketClientPtr
@@ -109,58 +397,310 @@ public:
      * @param  id ID of the client
      * @return    registered client (nullptr if no client with the given ID is registered)
      */
-    static SocketClientPtr GetClient(std::string id);
+    static SocketClientPtr GetClient(const std::string& id);
+
+    /**
+     * (THREAD SAFE) Indexes a registered client under the id of the room it serves (replacing
+     * the room it was indexed under), so commands for the room find it without a scan
+     * @param client   Client
+     * @param room_id  Id of the room (empty to only remove the client from the index)
+     */
+    static void SetClientRoom(SocketClient* client, const std::string& room_id);
 
     /**
-     * @return  a list of clients registered
+     * (THREAD SAFE, lock-free) Retrieves a registered client by the id of its room
+     * @param  room_id  Id of the room
+     * @return          registered client (nullptr if no client serves the room)
      */
-    static std::vector<SocketClientPtr> GetClientsList();
+    static SocketClientPtr GetClientByRoom(const std::string& room_id);
+
+    /**
+     * (THREAD SAFE, lock-free) Retrieves the registered clients. The snapshot is immutable and
+     * stays valid (as do the clients in it) for as long as it is held, even if clients are
+     * registered or deregistered in the meantime.
+     * @return  the latest snapshot of the registered clients
+     */
+    static std::shared_ptr<const CLIENTS_SNAPSHOT> GetClientsSnapshot();
 
     /**
      * Checks if a device requires an SSL connection
      * @param  device  Device to check
      */
     static bool DeviceRequiresSecureConnection(DISCOVERED_DEVICE device);
+
+    /**
+     * @return number of clients that were disconnected because their output reached the hard watermark
+     */
+    static uint64_t GetNumOverloadDisconnects();
+
+    /**
+     * (THREAD SAFE) Gathers the runtime statistics of the cluster: the loop iteration and ready
+     * client histograms of every reactor, the counters of every registered client (see
+     * SocketClient::GetStats()) and the occupancy of the buffer pool
+     * @return the statistics as JSON
+     */
+    static json GetStats();
 };
 
 
 /**
  * Abstract base class for a client to be managed by SocketCluster
  */
-class SocketClient {
+class SocketClient : public std::enable_shared_from_this<SocketClient> {
     friend class SocketCluster;
 
+    /**
+     * Connection state of a client
+     */
+    enum CLIENT_STATE {
+        /** Waiting for a connect slot in its reactor */
+        CLIENT_PENDING = 0,
+        /** connect() in progress */
+        CLIENT_CONNECTING = 1,
+        /** SSL handshake in progress */
+        CLIENT_HANDSHAKING = 2,
+        /** Connected and ready for traffic */
+        CLIENT_CONNECTED = 3,
+    };
+
     /** fd for the socket */
     int m_client_fd;
+    /** connection state (only modified by the owning reactor) */
+    std::atomic<CLIENT_STATE> m_state;
+    /** whether the SSL handshake waits for the socket to be writable (readable otherwise) */
+    bool m_handshake_wants_write;
+    /** deadline timer of the connect() (or SSL handshake) in progress (owned by the reactor's wheel) */
+    TimerWheel::TIMER* m_connect_timer;
+    /** whether the connect() (or SSL handshake) of this client takes one of its reactor's connect slots (reactor thread only) */
+    bool m_holds_connect_slot;
+    /** unique serial of this client (distinguishes reused fds in epoll events) */
+    uint32_t m_serial;
+    /** whether the cluster is watching m_client_fd for writing (only modified by the owning reactor) */
+    bool m_is_write_armed;
+    /** whether this client is in its reactor's dirty list */
+    std::atomic<bool> m_is_dirty;
+    /** reactor owning this client (set on registration) */
+    std::atomic<SocketCluster::Reactor*> m_reactor;
+    /** room the client is indexed under in clients_by_room (protected by SocketCluster::m_clients_mutex) */
+    std::string m_indexed_room_id;
     /** SSL object for m_client_fd */
     SSL* m_ssl;
-    /** mutex to protect modifying the write buffer */
-    std::mutex m_write_buffer_mutex;
-    /** pending write buffer */
-    std::vector<uint8_t> m_write_buffer;
-    /** pending read buffer */
-    std::vector<uint8_t> m_read_buffer;
+    /**
+     * A framed message waiting to be written to the socket
+     */
+    struct OUTPUT_SEGMENT {
+        /** Little-endian length of the payload */
+        uint8_t header[4];
+        /** Serialized message */
+        std::string payload;
+        /** thing targeted by the message if it is a state command (empty otherwise) */
+        std::string thing;
+
+        /** @return total number of bytes of the segment (header + payload) */
+        size_t size() const { return sizeof(header) + payload.size(); }
+
+        /**
+         * Sets the payload of the segment and its header
+         * @param data  Serialized message
+         */
+        void set_payload(std::string data);
+    };
+
+    /**
+     * A node in the outbox of a client
+     */
+    struct OUTBOX_NODE {
+        /** Framed message */
+        OUTPUT_SEGMENT segment;
+        /** Node pushed before this one */
+        OUTBOX_NODE* next;
+    };
+
+    /** head of the lock-free stack of segments written by any thread and not yet drained by the reactor */
+    std::atomic<OUTBOX_NODE*> m_outbox;
+    /** pending output segments, in write order (owning reactor only) */
+    std::deque<OUTPUT_SEGMENT> m_write_queue;
+    /** number of bytes of the front segment of m_write_queue that were already written */
+    size_t m_write_offset;
+    /** number of front segments of m_write_queue referenced by the io_uring write in progress (must not be modified) */
+    size_t m_segments_in_flight;
+    /** position (counting every segment ever queued) of the front segment of m_write_queue */
+    uint64_t m_write_queue_start;
+    /** thing -> position of its last state command in m_write_queue (owning reactor only) */
+    std::unordered_map<std::string, uint64_t> m_queued_state_commands;
+    /** position after the last segment of m_write_queue that is not a state command (state commands before it are not coalesced into) */
+    uint64_t m_queued_barrier;
+    /** buffers (struct iovec) of the io_uring write in progress (empty otherwise) */
+    PooledBuffer m_write_iov;
+    /** number of io_uring requests of this client in progress (owning reactor only) */
+    int m_uring_requests;
+    /** number of written bytes (in m_outbox or m_write_queue) not yet passed to the socket */
+    std::atomic<size_t> m_buffered_bytes;
+    /** number of bytes drained to m_write_queue not yet passed to the socket (owning reactor only) */
+    size_t m_queued_bytes;
+    /** whether this client was disconnected for reaching the hard watermark */
+    std::atomic<bool> m_is_overloaded;
+    /** monotonic time (ms) of the last bytes written to the socket of this client (or of the connection) */
+    std::atomic<milliseconds::rep> m_last_outbound_time;
+    /** monotonic time (ms) of the last bytes received from this client (or of the connection) */
+    std::atomic<milliseconds::rep> m_last_inbound_time;
+    /** traffic counters (only incremented by the owning reactor, read from any thread) */
+    std::atomic<uint64_t> m_bytes_received;
+    std::atomic<uint64_t> m_bytes_sent;
+    std::atomic<uint64_t> m_frames_received;
+    std::atomic<uint64_t> m_frames_sent;
+    /** number of received frames that could not be decoded (or were too big) */
+    std::atomic<uint64_t> m_parse_failures;
+    /** codec used to encode the messages written to this client (received messages are detected) */
+    std::atomic<MESSAGE_CODEC> m_codec;
+    /** pre-encoded heartbeat frames (empty object) for every codec, copied by every WriteHeartbeat() */
+    static const OUTPUT_SEGMENT m_heartbeat_segments[NUM_MESSAGE_CODECS];
+    /** bytes taken out of m_write_queue that are waiting to be passed to SSL_write() (empty once written) */
+    PooledBuffer m_ssl_write_staging;
+    /** number of bytes in m_ssl_write_staging */
+    size_t m_ssl_write_staging_size;
+    /** pending read buffer, received bytes are in [m_read_start, m_read_end) (empty once everything is parsed) */
+    PooledBuffer m_read_buffer;
+    /** index of the first unparsed byte in m_read_buffer */
+    size_t m_read_start;
+    /** index after the last received byte in m_read_buffer */
+    size_t m_read_end;
 
     /**
-     * Connects a socket to the given address
-     * @param  ip   IP to connect to
-     * @param  port port to connect to
+     * Creates a non-blocking socket to be connected by the cluster
+     * @param  ip   IP that will be connected to
+     * @param  port port that will be connected to
      * @return      socket FD, or negative value on failure
      */
     static int __openConnection(std::string ip, int port);
 
+    /**
+     * Initiates a non-blocking connect() of m_client_fd to m_ip:m_port
+     * @return 0 if the connection is established or in progress, negative value on failure
+     */
+    int __startConnecting();
+
+    /**
+     * @return the tag identifying this client in epoll events (serial << 32 | fd)
+     */
+    uint64_t __getEpollTag() const;
+
     /**
      * Called when there is pending data to be read from m_client_fd
      * @return whether or not the client should remain connected/registered
      */
     bool OnReadingAvailable();
 
+    /**
+     * Makes sure m_read_buffer has at least min_space free bytes after m_read_end, moving the
+     * unparsed bytes to the front of the buffer only when that avoids growing it
+     * @param min_space  Number of bytes needed after m_read_end
+     */
+    void __reserveReadSpace(size_t min_space);
+
+    /**
+     * Gives the I/O buffers back to the pool (once deregistered, except the ones used by an io_uring
+     * write in progress). Must be called from the owning reactor.
+     */
+    void __releaseBuffers();
+
+    /**
+     * Parses and dispatches all the complete frames in m_read_buffer
+     * @return whether or not the client should remain connected/registered
+     */
+    bool __parseReadFrames();
+
     /**
      * Called when there is room for data to be written to m_client_fd (and hopefully won't block)
      * @return whether or not the client should remain connected/registered
      */
     bool OnWritingAvailable();
 
+    /**
+     * Appends received bytes to m_read_buffer and parses them (for reads not done by OnReadingAvailable())
+     * @param data  Received bytes
+     * @param size  Number of bytes in data
+     * @return whether or not the client should remain connected/registered
+     */
+    bool __onBytesReceived(const uint8_t* data, size_t size);
+
+    /**
+     * Fills iov with the unwritten bytes of the queued segments
+     * @param iov           Buffers to fill (WRITEV_MAX_SEGMENTS * 2 of them)
+     * @param num_segments  Set to the number of segments referenced by iov
+     * @return number of buffers filled
+     */
+    int __fillWriteVector(struct iovec* iov, size_t* num_segments);
+
+    /**
+     * Writes the queued segments to m_client_fd with a single writev()
+     * @return number of bytes written (negative value on failure)
+     */
+    int __writeQueuedSegments();
+
+    /**
+     * Queues a drained segment at the back of m_write_queue and indexes it for coalescing
+     * @param segment  Framed message
+     */
+    void __pushWriteQueue(OUTPUT_SEGMENT&& segment);
+
+    /**
+     * Drops the (fully written) front segment of m_write_queue
+     */
+    void __popWriteQueue();
+
+    /**
+     * Drops the fully written segments from m_write_queue after a (non-TLS) write
+     * @param wbytes  Number of bytes written
+     */
+    void __onSegmentsWritten(size_t wbytes);
+
+    /**
+     * Aggregates queued segments into a TLS record sized buffer and writes it with SSL_write()
+     * @return number of bytes written (negative value on failure)
+     */
+    int __writeQueuedSegmentsSSL();
+
+    /**
+     * @param codec  Codec to encode the heartbeat with
+     * @return the framed heartbeat message
+     */
+    static OUTPUT_SEGMENT __makeHeartbeatSegment(MESSAGE_CODEC codec);
+
+    /**
+     * (THREAD SAFE) Pushes a framed segment to the outbox, applying the output watermarks, and
+     * signals the reactor. State commands above the soft watermark are only checked against
+     * the hard watermark by the reactor, once they are coalesced.
+     * @param segment        Framed message
+     * @param is_heartbeat   Whether the message is a heartbeat (dropped above the soft watermark)
+     * @return whether or not the segment was queued
+     */
+    bool __queueSegment(OUTPUT_SEGMENT segment, bool is_heartbeat);
+
+    /**
+     * Moves the segments of m_outbox to m_write_queue in write order, coalescing state
+     * commands above the soft watermark. Must be called from the owning reactor.
+     * @return false if the client was disconnected for reaching the hard watermark
+     */
+    bool __drainOutbox();
+
+    /**
+     * (THREAD SAFE) Disconnects the client for reaching the hard watermark (only once)
+     * @param buffered_bytes  Depth of the output of the client
+     */
+    void __onOverloaded(size_t buffered_bytes);
+
+    /**
+     * Merges a state command into the last queued command for the same thing, if that one was
+     * not partially written yet and no other kind of message is queued after it (the merged
+     * state is not reordered ahead of it). Must be called from the owning reactor.
+     * @param segment  State command (segment.thing is set)
+     * @param merged   index in m_write_queue -> decoded command, for the queued commands merged
+     *                 into during the current drain (they are re-encoded once, at the end)
+     * @return whether or not segment was merged (and shouldn't be queued)
+     */
+    bool __coalesceStateCommand(const OUTPUT_SEGMENT& segment, std::unordered_map<size_t, json>& merged);
+
 protected:
     /**
      * Initializes variables
@@ -173,10 +713,10 @@ protected:
 
 public:
     /**
-     * Creates a socket client and registers it in the system
-     * @param ip    Middleware server IP
-     * @param port  Middleware port
-     * @returns     The new client created, nullptr on failure
+     * Creates a socket client and registers it in the system. The connection is established
+     * asynchronously by the cluster, messages written in the meantime are queued.
+     * @param device  Discovered middleware
+     * @returns       The new client created, nullptr on failure
      */
     template<typename T>
     static SocketClientPtr Create(DISCOVERED_DEVICE device) {
@@ -187,7 +727,8 @@ public:
         if (fd <= 0)
             return nullptr;
         SocketClientPtr p = SocketClientPtr(new T(fd, device));
-        SocketCluster::RegisterClient(p);
+        if (SocketCluster::RegisterClient(p) != 0)
+            return nullptr;
         return p;
     }
 
@@ -197,16 +738,64 @@ public:
     virtual ~SocketClient();
 
     /**
-     * (SAFE) Writes a JSON-formatted message to the client socket
-     * @param msg JSON-formatted message to write
+     * (THREAD SAFE) Writes a JSON-formatted message to the client socket without blocking
+     * (the reactor owning the client does the I/O). Above the soft watermark
+     * heartbeats (empty messages) are dropped and state commands are merged into the queued
+     * command for the same thing, above the hard watermark the client is disconnected.
+     * @param msg JSON-formatted message to write (only serialized, never copied)
+     */
+    virtual void Write(const json& msg);
+
+    /**
+     * (THREAD SAFE) Writes the pre-encoded heartbeat frame to the client socket without blocking
      */
-    virtual void Write(json msg);
+    void WriteHeartbeat();
 
     /**
      * Can be implemented by a derived class to perform an action when a full JSON
      * message has been read from the socket
-     * @param  msg JSON message found
+     * @param  msg JSON message found (handed over, the callee may move from it, the base
+     *             implementation only logs it)
      * @return     whether or not the client should remain connected/registered
      */
-    virtual bool OnMessage(json msg);
+    virtual bool OnMessage(json&& msg);
+
+    /**
+     * (THREAD SAFE) Retrieves the depth of the output buffer of this client
+     * @return number of bytes waiting to be written to the socket
+     */
+    size_t GetBufferedBytes() const;
+
+    /**
+     * (THREAD SAFE) Sets the codec used to encode the messages written to this client from now on
+     * @param codec  Codec negotiated with the client
+     */
+    void SetCodec(MESSAGE_CODEC codec);
+
+    /**
+     * (THREAD SAFE) @return the codec used to encode the messages written to this client
+     */
+    MESSAGE_CODEC GetCodec() const;
+
+    /**
+     * (THREAD SAFE) @return whether the connection (and handshake) of this client is established
+     */
+    bool IsConnected() const;
+
+    /**
+     * (THREAD SAFE) @return monotonic time of the last bytes written to the socket of this client
+     */
+    milliseconds GetLastOutboundTime() const;
+
+    /**
+     * (THREAD SAFE) @return monotonic time of the last bytes received from this client (or of
+     *                       the connection if nothing was received since)
+     */
+    milliseconds GetLastInboundTime() const;
+
+    /**
+     * (THREAD SAFE) @return the traffic counters of this client, its output queue depth (bytes)
+     *                       and the time (ms) since it last received and sent
+     */
+    json GetStats() const;
 };
@@ -0,0 +1,126 @@
+#include "utilities/buffer_pool.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+BufferPool::SIZE_CLASS BufferPool::m_classes[BUFFER_POOL_NUM_CLASSES];
+std::atomic<size_t> BufferPool::m_bytes_in_use(0);
+std::atomic<size_t> BufferPool::m_max_bytes_in_use(0);
+
+int BufferPool::__getClassIndex(size_t size) {
+    size_t class_size = BUFFER_POOL_MIN_SIZE;
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++, class_size <<= 1)
+        if (size <= class_size)
+            return i;
+    return -1;
+}
+
+uint8_t* BufferPool::Acquire(size_t min_size, size_t* capacity) {
+    int index = __getClassIndex(min_size);
+    uint8_t* buffer = nullptr;
+    if (index < 0) {
+        *capacity = min_size;
+        buffer = new uint8_t[min_size];
+    } else {
+        SIZE_CLASS& size_class = m_classes[index];
+        *capacity = (size_t)BUFFER_POOL_MIN_SIZE << index;
+
+        size_class.mutex.lock();
+        if (size_class.free_buffers.size() > 0) {
+            buffer = size_class.free_buffers.back();
+            size_class.free_buffers.pop_back();
+        } else
+            size_class.num_allocated++;
+        size_class.num_acquired++;
+        size_class.num_in_use++;
+        size_class.max_in_use = std::max(size_class.max_in_use, size_class.num_in_use);
+        size_class.mutex.unlock();
+
+        if (!buffer)
+            buffer = new uint8_t[*capacity];
+    }
+
+    size_t bytes_in_use = (m_bytes_in_use += *capacity);
+    size_t max_bytes_in_use = m_max_bytes_in_use;
+    while (bytes_in_use > max_bytes_in_use && !m_max_bytes_in_use.compare_exchange_weak(max_bytes_in_use, bytes_in_use))
+        ;
+
+    return buffer;
+}
+
+void BufferPool::Release(uint8_t* buffer, size_t capacity) {
+    m_bytes_in_use -= capacity;
+
+    int index = __getClassIndex(capacity);
+    bool is_cached = false;
+    if (index >= 0) {
+        SIZE_CLASS& size_class = m_classes[index];
+        size_class.mutex.lock();
+        size_class.num_in_use--;
+        // the classes above BUFFER_POOL_MAX_CACHED_BYTES never keep their (rare) buffers
+        if ((size_class.free_buffers.size() + 1) * capacity <= BUFFER_POOL_MAX_CACHED_BYTES) {
+            size_class.free_buffers.push_back(buffer);
+            is_cached = true;
+        }
+        size_class.mutex.unlock();
+    }
+
+    if (!is_cached)
+        delete[] buffer;
+}
+
+json BufferPool::GetStats() {
+    json stats;
+    stats["classes"] = json::array();
+    size_t bytes_cached = 0;
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++) {
+        SIZE_CLASS& size_class = m_classes[i];
+        size_t size = (size_t)BUFFER_POOL_MIN_SIZE << i;
+        size_class.mutex.lock();
+        if (size_class.num_acquired > 0) {
+            stats["classes"].push_back({
+                {"size", size},
+                {"in_use", size_class.num_in_use},
+                {"max_in_use", size_class.max_in_use},
+                {"cached", size_class.free_buffers.size()},
+                {"acquired", size_class.num_acquired},
+                {"allocated", size_class.num_allocated},
+            });
+        }
+        bytes_cached += size_class.free_buffers.size() * size;
+        size_class.mutex.unlock();
+    }
+    stats["bytes_in_use"] = (size_t)m_bytes_in_use;
+    stats["max_bytes_in_use"] = (size_t)m_max_bytes_in_use;
+    stats["bytes_cached"] = bytes_cached;
+    return stats;
+}
+
+PooledBuffer::PooledBuffer() : m_data(nullptr), m_capacity(0) {
+}
+
+PooledBuffer::~PooledBuffer() {
+    Release();
+}
+
+void PooledBuffer::Reserve(size_t min_capacity, size_t preserved) {
+    if (m_capacity >= min_capacity)
+        return;
+
+    size_t capacity;
+    uint8_t* data = BufferPool::Acquire(min_capacity, &capacity);
+    if (m_data) {
+        memcpy(data, m_data, std::min(preserved, m_capacity));
+        BufferPool::Release(m_data, m_capacity);
+    }
+    m_data = data;
+    m_capacity = capacity;
+}
+
+void PooledBuffer::Release() {
+    if (m_data)
+        BufferPool::Release(m_data, m_capacity);
+    m_data = nullptr;
+    m_capacity = 0;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <json.hpp>
+using json = nlohmann::json;
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** Size of the smallest buffers of the BufferPool (bytes) */
+#define BUFFER_POOL_MIN_SIZE 4096
+
+/** Number of size classes of the BufferPool (powers of 2 from BUFFER_POOL_MIN_SIZE up to 16MB) */
+#define BUFFER_POOL_NUM_CLASSES 13
+
+/** Maximum number of bytes of free buffers kept by each size class (the rest goes back to the heap) */
+#define BUFFER_POOL_MAX_CACHED_BYTES (1024 * 1024)
+
+/**
+ * (THREAD SAFE) Pool of the I/O buffers shared by all the clients of the cluster.
+ *
+ * Buffers come in power of 2 size classes, each with its own free list and mutex. Released
+ * buffers are kept for reuse (up to BUFFER_POOL_MAX_CACHED_BYTES per class) instead of
+ * going back to the heap, so connections taking and giving back buffers all day don't
+ * fragment it. Larger requests than the biggest class are allocated and freed directly.
+ */
+class BufferPool {
+    /**
+     * Free list and statistics of a size class
+     */
+    struct SIZE_CLASS {
+        /** protects the members below */
+        std::mutex mutex;
+        /** released buffers kept for reuse */
+        std::vector<uint8_t*> free_buffers;
+        /** number of buffers currently acquired */
+        size_t num_in_use;
+        /** highest num_in_use */
+        size_t max_in_use;
+        /** number of Acquire() calls served by this class */
+        uint64_t num_acquired;
+        /** number of Acquire() calls that had to allocate (free list empty) */
+        uint64_t num_allocated;
+    };
+
+    /** size classes (class i holds buffers of BUFFER_POOL_MIN_SIZE << i bytes) */
+    static SIZE_CLASS m_classes[BUFFER_POOL_NUM_CLASSES];
+    /** number of bytes of all the buffers currently acquired */
+    static std::atomic<size_t> m_bytes_in_use;
+    /** highest m_bytes_in_use */
+    static std::atomic<size_t> m_max_bytes_in_use;
+
+    /**
+     * @param size  Number of bytes needed
+     * @return index of the smallest class holding size bytes, -1 if size is too big for all of them
+     */
+    static int __getClassIndex(size_t size);
+
+public:
+    /**
+     * Takes a buffer from the pool
+     * @param min_size  Number of bytes needed
+     * @param capacity  Set to the actual size of the buffer (>= min_size)
+     * @return the buffer
+     */
+    static uint8_t* Acquire(size_t min_size, size_t* capacity);
+
+    /**
+     * Gives a buffer back to the pool
+     * @param buffer    Buffer returned by Acquire()
+     * @param capacity  Size of the buffer (as set by Acquire())
+     */
+    static void Release(uint8_t* buffer, size_t capacity);
+
+    /**
+     * @return occupancy (buffers in use and cached) and high-water marks of the pool, per size class and in total
+     */
+    static json GetStats();
+};
+
+/**
+ * A buffer taken from the BufferPool, given back when released or destroyed. An empty (released)
+ * buffer holds no memory.
+ */
+class PooledBuffer {
+    /** buffer (nullptr if empty) */
+    uint8_t* m_data;
+    /** size of m_data */
+    size_t m_capacity;
+
+public:
+    PooledBuffer();
+    ~PooledBuffer();
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    /** @return the buffer (nullptr if empty) */
+    uint8_t* data() const { return m_data; }
+
+    /** @return size of the buffer (0 if empty) */
+    size_t capacity() const { return m_capacity; }
+
+    /**
+     * Makes sure the buffer holds at least min_capacity bytes (taking a bigger one from the pool if needed)
+     * @param min_capacity  Number of bytes needed
+     * @param preserved     Number of bytes at the start of the buffer to keep if it is replaced
+     */
+    void Reserve(size_t min_capacity, size_t preserved);
+
+    /**
+     * Gives the buffer back to the pool
+     */
+    void Release();
+};
@@ -0,0 +1,68 @@
+#include "utilities/histogram.hpp"
+
+#include <string>
+#include <algorithm>
+
+Histogram::Histogram() : m_count(0), m_sum(0), m_max(0) {
+    for (int i = 0; i < HISTOGRAM_NUM_BUCKETS; i++)
+        m_buckets[i] = 0;
+}
+
+int Histogram::__getBucketIndex(uint64_t value) {
+    if (value == 0)
+        return 0;
+    int index = 64 - __builtin_clzll(value);
+    return index < HISTOGRAM_NUM_BUCKETS ? index : HISTOGRAM_NUM_BUCKETS - 1;
+}
+
+uint64_t Histogram::__getBucketUpperBound(int index) {
+    if (index == HISTOGRAM_NUM_BUCKETS - 1)
+        return UINT64_MAX;
+    return (((uint64_t)1) << index) - 1;
+}
+
+uint64_t Histogram::__getPercentile(const uint64_t* counts, uint64_t count, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank)
+            return __getBucketUpperBound(i);
+    }
+    return __getBucketUpperBound(HISTOGRAM_NUM_BUCKETS - 1);
+}
+
+void Histogram::Record(uint64_t value) {
+    m_buckets[__getBucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        ;
+}
+
+json Histogram::ToJson() const {
+    uint64_t counts[HISTOGRAM_NUM_BUCKETS];
+    uint64_t count = 0;
+    json buckets = json::object();
+    for (int i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+        count += counts[i];
+        if (counts[i] > 0)
+            buckets[i == HISTOGRAM_NUM_BUCKETS - 1 ? "inf" : std::to_string(__getBucketUpperBound(i))] = counts[i];
+    }
+
+    // a bucket's upper bound can be far above what was actually recorded
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    json stats;
+    stats["count"] = count;
+    stats["mean"] = count > 0 ? m_sum.load(std::memory_order_relaxed) / count : 0;
+    stats["max"] = max;
+    if (count > 0) {
+        stats["p50"] = std::min(max, __getPercentile(counts, count, 0.5));
+        stats["p90"] = std::min(max, __getPercentile(counts, count, 0.9));
+        stats["p99"] = std::min(max, __getPercentile(counts, count, 0.99));
+    }
+    stats["buckets"] = buckets;
+    return stats;
+}
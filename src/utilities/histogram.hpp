@@ -0,0 +1,63 @@
+#pragma once
+
+#include <json.hpp>
+using json = nlohmann::json;
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/** Number of buckets of a Histogram (bucket i > 0 counts the values in [2^(i-1), 2^i), the last one everything above) */
+#define HISTOGRAM_NUM_BUCKETS 32
+
+/**
+ * (THREAD SAFE, lock-free) Histogram of log2 buckets, cheap enough to record every event of a
+ * hot loop (a few relaxed atomic increments, no allocation). Meant to have a single writer (the
+ * event loop owning it) while being read from any thread, so the counts read by ToJson() are
+ * only approximately consistent with each other.
+ */
+class Histogram {
+    /** number of recorded values per bucket */
+    std::atomic<uint64_t> m_buckets[HISTOGRAM_NUM_BUCKETS];
+    /** number of recorded values */
+    std::atomic<uint64_t> m_count;
+    /** sum of the recorded values */
+    std::atomic<uint64_t> m_sum;
+    /** highest recorded value */
+    std::atomic<uint64_t> m_max;
+
+    /**
+     * @param value  Recorded value
+     * @return index of the bucket counting value
+     */
+    static int __getBucketIndex(uint64_t value);
+
+    /**
+     * @param index  Index of a bucket
+     * @return highest value counted by the bucket
+     */
+    static uint64_t __getBucketUpperBound(int index);
+
+    /**
+     * @param counts     Snapshot of m_buckets
+     * @param count      Sum of counts
+     * @param fraction   Fraction of the values at or below the percentile (0.5 for the median)
+     * @return upper bound of the bucket holding the percentile
+     */
+    static uint64_t __getPercentile(const uint64_t* counts, uint64_t count, double fraction);
+
+public:
+    Histogram();
+
+    /**
+     * Counts a value
+     * @param value  Value to count
+     */
+    void Record(uint64_t value);
+
+    /**
+     * @return {"count", "mean", "max", "p50", "p90", "p99", "buckets": {upper bound -> count}}
+     *         (percentiles are the upper bounds of their bucket capped to max, only non-empty buckets are listed)
+     */
+    json ToJson() const;
+};
@@ -0,0 +1,371 @@
+#include "utilities/io_ring.hpp"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <algorithm>
+
+#if HAS_IO_URING
+
+/** Operations needed by the SocketCluster (multishot receives and provided buffer rings are probed separately) */
+static const int g_required_ops[] = {IORING_OP_POLL_ADD, IORING_OP_RECV, IORING_OP_WRITEV, IORING_OP_ASYNC_CANCEL, IORING_OP_LINK_TIMEOUT};
+
+/** Time allowed for the multishot receive of IsSupported() to complete (ms) */
+#define MULTISHOT_PROBE_TIMEOUT 1000
+
+IORing::IORing() : m_ring_fd(-1), m_sq_ring(MAP_FAILED), m_sq_ring_size(0), m_cq_ring(MAP_FAILED), m_cq_ring_size(0), m_sqes(MAP_FAILED), m_sqes_size(0), m_sq_entries(0), m_num_pending(0), m_buffer_ring(MAP_FAILED), m_buffer_ring_size(0), m_buffers(nullptr), m_num_buffers(0), m_buffer_size(0), m_buffer_tail(0) {
+}
+
+IORing::~IORing() {
+    Destroy();
+}
+
+bool IORing::IsSupported() {
+    // Create() registers a provided buffers ring (IORING_REGISTER_PBUF_RING)
+    IORing ring;
+    if (ring.Create(8, 8, 64) != 0)
+        return false;
+
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_size);
+    bool is_supported = syscall(__NR_io_uring_register, ring.m_ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; is_supported && i < sizeof(g_required_ops) / sizeof(g_required_ops[0]); i++) {
+        int op = g_required_ops[i];
+        is_supported = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+
+    return is_supported && ring.__probeRecvMultishot();
+}
+
+bool IORing::__probeRecvMultishot() {
+    // kernels without multishot receives reject the flag (-EINVAL) when the receive runs
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return false;
+
+    bool is_supported = false;
+    COMPLETION completion;
+    if (PrepRecvMultishot(fds[0], 0) == 0 && write(fds[1], "", 1) == 1 &&
+        SubmitAndWait(MULTISHOT_PROBE_TIMEOUT) == 0 && PopCompletion(&completion))
+        is_supported = completion.result == 1 && completion.has_buffer && completion.has_more;
+
+    // the receive is cancelled with the ring
+    close(fds[0]);
+    close(fds[1]);
+    return is_supported;
+}
+
+int IORing::Create(unsigned entries, unsigned num_buffers, unsigned buffer_size) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    m_ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (m_ring_fd < 0 && errno == EINVAL) {
+        // flags unknown to older kernels
+        memset(&params, 0, sizeof(params));
+        m_ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (m_ring_fd < 0)
+        return -1;
+
+    unsigned required_features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & required_features) != required_features) {
+        Destroy();
+        return -2;
+    }
+
+    // the submission and completion rings share a single mapping
+    m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+    m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ring == MAP_FAILED) {
+        Destroy();
+        return -3;
+    }
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        Destroy();
+        return -4;
+    }
+
+    uint8_t* sq = (uint8_t*)m_sq_ring;
+    m_sq_head = (unsigned*)(sq + params.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    m_sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    m_sq_array = (unsigned*)(sq + params.sq_off.array);
+    m_sq_entries = params.sq_entries;
+    m_cq_head = (unsigned*)(sq + params.cq_off.head);
+    m_cq_tail = (unsigned*)(sq + params.cq_off.tail);
+    m_cq_mask = *(unsigned*)(sq + params.cq_off.ring_mask);
+    m_cqes = sq + params.cq_off.cqes;
+    m_timeouts.assign(params.sq_entries * 2, 0);
+
+    // provided buffers
+    m_num_buffers = num_buffers;
+    m_buffer_size = buffer_size;
+    m_buffer_ring_size = num_buffers * sizeof(struct io_uring_buf);
+    m_buffer_ring = mmap(nullptr, m_buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_buffer_ring == MAP_FAILED) {
+        Destroy();
+        return -5;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)m_buffer_ring;
+    reg.ring_entries = num_buffers;
+    reg.bgid = BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        Destroy();
+        return -6;
+    }
+    m_buffers = new uint8_t[(size_t)num_buffers * buffer_size];
+    for (unsigned i = 0; i < num_buffers; i++)
+        __addBuffer((uint16_t)i);
+
+    return 0;
+}
+
+void IORing::Destroy() {
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqes_size);
+    m_sqes = MAP_FAILED;
+    if (m_sq_ring != MAP_FAILED)
+        munmap(m_sq_ring, m_sq_ring_size);
+    m_sq_ring = m_cq_ring = MAP_FAILED;
+    if (m_ring_fd >= 0)
+        close(m_ring_fd);
+    m_ring_fd = -1;
+    if (m_buffer_ring != MAP_FAILED)
+        munmap(m_buffer_ring, m_buffer_ring_size);
+    m_buffer_ring = MAP_FAILED;
+    delete[] m_buffers;
+    m_buffers = nullptr;
+    m_num_pending = 0;
+    m_buffer_tail = 0;
+}
+
+void* IORing::__getSQE() {
+    if (m_ring_fd < 0)
+        return nullptr;
+
+    unsigned tail = *m_sq_tail; // only written by this thread
+    if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+        // full, submit what is queued to make room
+        int submitted = (int)syscall(__NR_io_uring_enter, m_ring_fd, m_num_pending, 0, 0, nullptr, 0);
+        if (submitted > 0)
+            m_num_pending -= std::min(m_num_pending, (unsigned)submitted);
+        if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+            return nullptr;
+    }
+
+    // the kernel only reads the entry on io_uring_enter(), so it can be published before it is filled
+    unsigned index = tail & m_sq_mask;
+    struct io_uring_sqe* sqe = &((struct io_uring_sqe*)m_sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    m_num_pending++;
+    return sqe;
+}
+
+void IORing::__addBuffer(uint16_t buffer_id) {
+    struct io_uring_buf_ring* ring = (struct io_uring_buf_ring*)m_buffer_ring;
+    // not ring->bufs: C++ pads the flexible array declared by the header
+    struct io_uring_buf* buffer = (struct io_uring_buf*)m_buffer_ring + (m_buffer_tail & (m_num_buffers - 1));
+    buffer->addr = (uint64_t)(m_buffers + (size_t)buffer_id * m_buffer_size);
+    buffer->len = m_buffer_size;
+    buffer->bid = buffer_id;
+    m_buffer_tail++;
+    __atomic_store_n(&ring->tail, m_buffer_tail, __ATOMIC_RELEASE);
+}
+
+int IORing::PrepPoll(int fd, uint32_t poll_mask, bool multishot, uint64_t user_data) {
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)__getSQE();
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = poll_mask;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int IORing::PrepPollWithTimeout(int fd, uint32_t poll_mask, milliseconds timeout, uint64_t user_data, uint64_t timeout_user_data) {
+    // both entries must be submitted together for the link to hold
+    if (m_ring_fd < 0 || *m_sq_tail + 2 - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) > m_sq_entries) {
+        if (SubmitAndWait(0) != 0)
+            return -1;
+    }
+
+    if (PrepPoll(fd, poll_mask, false, user_data) != 0)
+        return -1;
+    struct io_uring_sqe* poll_sqe = &((struct io_uring_sqe*)m_sqes)[(*m_sq_tail - 1) & m_sq_mask];
+    poll_sqe->flags |= IOSQE_IO_LINK;
+
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)__getSQE();
+    if (!sqe)
+        return -2;
+    unsigned index = (unsigned)(sqe - (struct io_uring_sqe*)m_sqes);
+    int64_t* timespec = &m_timeouts[index * 2];
+    timespec[0] = timeout.count() / 1000;
+    timespec[1] = (timeout.count() % 1000) * 1000000;
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)timespec;
+    sqe->len = 1;
+    sqe->user_data = timeout_user_data;
+    return 0;
+}
+
+int IORing::PrepRecvMultishot(int fd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)__getSQE();
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int IORing::PrepWritev(int fd, const struct iovec* iov, int iovcnt, uint64_t user_data) {
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)__getSQE();
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)iov;
+    sqe->len = (uint32_t)iovcnt;
+    sqe->off = (uint64_t)-1; // sockets have no file position
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int IORing::PrepCancelAll(int fd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)__getSQE();
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int IORing::SubmitAndWait(int timeout_ms) {
+    if (m_ring_fd < 0)
+        return -1;
+
+    struct __kernel_timespec timeout;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)&timeout;
+    }
+
+    int ret = (int)syscall(__NR_io_uring_enter, m_ring_fd, m_num_pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret >= 0) {
+        m_num_pending -= std::min(m_num_pending, (unsigned)ret);
+        return 0;
+    }
+    // ETIME: timed out, EBUSY: completions must be consumed first
+    if (errno == ETIME || errno == EINTR || errno == EBUSY)
+        return 0;
+    return -errno;
+}
+
+bool IORing::PopCompletion(COMPLETION* completion) {
+    if (m_ring_fd < 0)
+        return false;
+
+    unsigned head = *m_cq_head; // only written by this thread
+    if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    const struct io_uring_cqe* cqe = &((const struct io_uring_cqe*)m_cqes)[head & m_cq_mask];
+    completion->user_data = cqe->user_data;
+    completion->result = cqe->res;
+    completion->has_more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    completion->has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    completion->buffer_id = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint8_t* IORing::GetBuffer(uint16_t buffer_id) {
+    return m_buffers + (size_t)buffer_id * m_buffer_size;
+}
+
+void IORing::RecycleBuffer(uint16_t buffer_id) {
+    if (m_ring_fd >= 0)
+        __addBuffer(buffer_id);
+}
+
+#else // !HAS_IO_URING
+
+IORing::IORing() : m_ring_fd(-1), m_buffers(nullptr) {
+}
+
+IORing::~IORing() {
+}
+
+bool IORing::IsSupported() {
+    return false;
+}
+
+int IORing::Create(unsigned entries, unsigned num_buffers, unsigned buffer_size) {
+    return -1;
+}
+
+void IORing::Destroy() {
+}
+
+int IORing::PrepPoll(int fd, uint32_t poll_mask, bool multishot, uint64_t user_data) {
+    return -1;
+}
+
+int IORing::PrepPollWithTimeout(int fd, uint32_t poll_mask, milliseconds timeout, uint64_t user_data, uint64_t timeout_user_data) {
+    return -1;
+}
+
+int IORing::PrepRecvMultishot(int fd, uint64_t user_data) {
+    return -1;
+}
+
+int IORing::PrepWritev(int fd, const struct iovec* iov, int iovcnt, uint64_t user_data) {
+    return -1;
+}
+
+int IORing::PrepCancelAll(int fd, uint64_t user_data) {
+    return -1;
+}
+
+int IORing::SubmitAndWait(int timeout_ms) {
+    return -1;
+}
+
+bool IORing::PopCompletion(COMPLETION* completion) {
+    return false;
+}
+
+uint8_t* IORing::GetBuffer(uint16_t buffer_id) {
+    return nullptr;
+}
+
+void IORing::RecycleBuffer(uint16_t buffer_id) {
+}
+
+#endif // HAS_IO_URING
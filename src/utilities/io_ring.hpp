@@ -0,0 +1,208 @@
+#pragma once
+
+#include "utilities/time_utilities.hpp"
+
+#include <sys/uio.h>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ASYNC_CANCEL_FD)
+/** Whether io_uring support is compiled in (needs the headers of Linux 6.0 or newer) */
+#define HAS_IO_URING 1
+#else
+#define HAS_IO_URING 0
+#endif
+
+/**
+ * Minimal io_uring wrapper (NOT thread safe, meant to be owned by a single event loop),
+ * talking to the kernel with the raw syscalls.
+ *
+ * Requests are only queued by the Prep*() functions, and are all submitted by the next
+ * SubmitAndWait() with a single io_uring_enter() that also waits for completions. Receives
+ * use a ring of provided buffers registered with the kernel (the kernel picks a buffer when
+ * data arrives, so no buffer is tied to an idle socket), which must be given back with
+ * RecycleBuffer() once consumed.
+ *
+ * When the headers or the kernel do not support io_uring (see IsSupported()), Create()
+ * fails and the other functions do nothing.
+ */
+class IORing {
+public:
+    /**
+     * A completed request
+     */
+    struct COMPLETION {
+        /** user_data of the request */
+        uint64_t user_data;
+        /** result of the request (negative errno on failure) */
+        int result;
+        /** whether the (multishot) request will complete again */
+        bool has_more;
+        /** whether a provided buffer holds the received bytes */
+        bool has_buffer;
+        /** index of the provided buffer (if has_buffer) */
+        uint16_t buffer_id;
+    };
+
+private:
+    /** io_uring fd */
+    int m_ring_fd;
+    /** mmap'ed submission/completion rings and submission entries */
+    void* m_sq_ring;
+    size_t m_sq_ring_size;
+    void* m_cq_ring;
+    size_t m_cq_ring_size;
+    void* m_sqes;
+    size_t m_sqes_size;
+    /** pointers into the rings */
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned* m_sq_array;
+    unsigned m_sq_entries;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    void* m_cqes;
+    /** submission entries queued since the last submission */
+    unsigned m_num_pending;
+    /** timeouts of the queued linked timeouts (indexed like the submission entries, read by the kernel on submission) */
+    std::vector<int64_t> m_timeouts;
+    /** provided buffers ring (shared with the kernel) and the buffers themselves */
+    void* m_buffer_ring;
+    size_t m_buffer_ring_size;
+    uint8_t* m_buffers;
+    unsigned m_num_buffers;
+    unsigned m_buffer_size;
+    /** next tail of the provided buffers ring */
+    uint16_t m_buffer_tail;
+
+    /**
+     * @return a zeroed submission entry (flushing the queued ones if the ring is full), nullptr on failure
+     */
+    void* __getSQE();
+
+    /**
+     * Gives a buffer to the kernel
+     * @param buffer_id  Index of the buffer
+     */
+    void __addBuffer(uint16_t buffer_id);
+
+    /**
+     * Runs a multishot receive on a socket pair (the ring must be created)
+     * @return whether the receive completed into a provided buffer and stayed armed
+     */
+    bool __probeRecvMultishot();
+
+public:
+    /** Group of the provided buffers */
+    static const uint16_t BUFFER_GROUP = 0;
+
+    IORing();
+
+    /**
+     * Frees all resources
+     */
+    ~IORing();
+
+    /**
+     * @return whether io_uring can be used with all the features needed (multishot receives,
+     *         provided buffer rings, linked timeouts, and waiting with a timeout)
+     */
+    static bool IsSupported();
+
+    /**
+     * Sets up the ring and registers the provided buffers
+     * @param entries      Number of submission entries
+     * @param num_buffers  Number of provided buffers (power of 2)
+     * @param buffer_size  Size of each provided buffer
+     * @return 0 on success, negative value on failure
+     */
+    int Create(unsigned entries, unsigned num_buffers, unsigned buffer_size);
+
+    /**
+     * Frees all resources (requests in progress are cancelled by the kernel)
+     */
+    void Destroy();
+
+    /**
+     * Queues a poll of fd
+     * @param fd         File descriptor
+     * @param poll_mask  POLLIN/POLLOUT
+     * @param multishot  Whether the poll completes on every readiness (until it is cancelled)
+     * @param user_data  Identifies the request in its completions
+     * @return 0 on success, negative value on failure
+     */
+    int PrepPoll(int fd, uint32_t poll_mask, bool multishot, uint64_t user_data);
+
+    /**
+     * Queues a one shot poll of fd, cancelled if it doesn't complete in time (its completion
+     * then has -ECANCELED, and the timeout's completion -ETIME)
+     * @param fd                 File descriptor
+     * @param poll_mask          POLLIN/POLLOUT
+     * @param timeout            Time allowed for the poll to complete
+     * @param user_data          Identifies the poll in its completion
+     * @param timeout_user_data  Identifies the timeout in its completion
+     * @return 0 on success, negative value on failure
+     */
+    int PrepPollWithTimeout(int fd, uint32_t poll_mask, milliseconds timeout, uint64_t user_data, uint64_t timeout_user_data);
+
+    /**
+     * Queues a multishot receive into the provided buffers
+     * @param fd         Socket
+     * @param user_data  Identifies the request in its completions
+     * @return 0 on success, negative value on failure
+     */
+    int PrepRecvMultishot(int fd, uint64_t user_data);
+
+    /**
+     * Queues a writev(). The iovecs and the memory they point to must stay valid until completion.
+     * @param fd         File descriptor
+     * @param iov        Buffers to write
+     * @param iovcnt     Number of buffers
+     * @param user_data  Identifies the request in its completion
+     * @return 0 on success, negative value on failure
+     */
+    int PrepWritev(int fd, const struct iovec* iov, int iovcnt, uint64_t user_data);
+
+    /**
+     * Queues the cancellation of all the requests on fd
+     * @param fd         File descriptor
+     * @param user_data  Identifies the request in its completion
+     * @return 0 on success, negative value on failure
+     */
+    int PrepCancelAll(int fd, uint64_t user_data);
+
+    /**
+     * Submits the queued requests and waits for a completion
+     * @param timeout_ms  Maximum time to wait (-1 to wait indefinitely)
+     * @return 0 on success (or timeout), negative value on failure
+     */
+    int SubmitAndWait(int timeout_ms);
+
+    /**
+     * Retrieves the next completion
+     * @param completion  Set to the completion
+     * @return whether or not there was a completion
+     */
+    bool PopCompletion(COMPLETION* completion);
+
+    /**
+     * @param buffer_id  Index of a provided buffer
+     * @return the buffer
+     */
+    uint8_t* GetBuffer(uint16_t buffer_id);
+
+    /**
+     * Gives a consumed buffer back to the kernel
+     * @param buffer_id  Index of the buffer
+     */
+    void RecycleBuffer(uint16_t buffer_id);
+};
@@ -0,0 +1,66 @@
+#include "utilities/message_codec.hpp"
+
+std::string __encode_message(const json& msg, MESSAGE_CODEC codec) {
+    std::string encoded;
+    switch (codec) {
+        case CODEC_CBOR:
+            json::to_cbor(msg, encoded);
+            break;
+        case CODEC_MSGPACK:
+            json::to_msgpack(msg, encoded);
+            break;
+        default:
+            encoded = msg.dump();
+    }
+    return encoded;
+}
+
+MESSAGE_CODEC __detect_codec(const uint8_t* data, size_t size) {
+    if (size == 0)
+        return CODEC_JSON;
+    uint8_t first = data[0];
+    if (first >= 0xA0 && first <= 0xBF)
+        return CODEC_CBOR;
+    if ((first >= 0x80 && first <= 0x8F) || first == 0xDE || first == 0xDF)
+        return CODEC_MSGPACK;
+    return CODEC_JSON;
+}
+
+int __decode_message(const uint8_t* data, size_t size, json& msg) {
+    try {
+        switch (__detect_codec(data, size)) {
+            case CODEC_CBOR:
+                msg = json::from_cbor(data, data + size);
+                break;
+            case CODEC_MSGPACK:
+                msg = json::from_msgpack(data, data + size);
+                break;
+            default:
+                msg = json::parse(data, data + size);
+        }
+    } catch (...) {
+        return -1;
+    }
+    return 0;
+}
+
+std::string __codec_name(MESSAGE_CODEC codec) {
+    switch (codec) {
+        case CODEC_CBOR:
+            return "cbor";
+        case CODEC_MSGPACK:
+            return "msgpack";
+        default:
+            return "json";
+    }
+}
+
+int __codec_from_name(const std::string& name, MESSAGE_CODEC* codec) {
+    for (int i = 0; i < NUM_MESSAGE_CODECS; i++) {
+        if (__codec_name((MESSAGE_CODEC)i) == name) {
+            *codec = (MESSAGE_CODEC)i;
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <json.hpp>
+using json = nlohmann::json;
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Encodings of the messages exchanged with the middlewares
+ */
+enum MESSAGE_CODEC {
+    /** JSON text (always supported, used until another codec is negotiated) */
+    CODEC_JSON = 0,
+    /** CBOR (RFC 7049) */
+    CODEC_CBOR = 1,
+    /** MessagePack */
+    CODEC_MSGPACK = 2,
+};
+
+/** Number of MESSAGE_CODEC values */
+#define NUM_MESSAGE_CODECS 3
+
+/**
+ * Encodes a message
+ * @param msg    Message to encode
+ * @param codec  Codec to use
+ * @return encoded bytes
+ */
+std::string __encode_message(const json& msg, MESSAGE_CODEC codec);
+
+/**
+ * Detects the codec of an encoded message from its first byte. Messages are JSON objects,
+ * and the first bytes of an object differ in all the codecs: '{' (or whitespace) for JSON,
+ * 0xA0-0xBF for a CBOR map and 0x80-0x8F/0xDE/0xDF for a MessagePack map.
+ * @param data  Encoded message
+ * @param size  Number of bytes in data
+ * @return codec of the message (CODEC_JSON if it is not recognized)
+ */
+MESSAGE_CODEC __detect_codec(const uint8_t* data, size_t size);
+
+/**
+ * Decodes a message encoded with any of the codecs (see __detect_codec())
+ * @param data  Encoded message
+ * @param size  Number of bytes in data
+ * @param msg   Decoded message (only set on success)
+ * @return 0 on success, negative value on failure
+ */
+int __decode_message(const uint8_t* data, size_t size, json& msg);
+
+/**
+ * @param codec  Codec
+ * @return name of the codec used in the negotiation ("json", "cbor" or "msgpack")
+ */
+std::string __codec_name(MESSAGE_CODEC codec);
+
+/**
+ * Looks up a codec by its name
+ * @param name   Name of the codec ("json", "cbor" or "msgpack")
+ * @param codec  Set to the codec on success
+ * @return 0 on success, negative value if the name is unknown
+ */
+int __codec_from_name(const std::string& name, MESSAGE_CODEC* codec);
@@ -21,6 +21,18 @@ int __robust_write(int fd, uint8_t* buf, size_t buflen) {
     return wbytes;
 }
 
+int __robust_writev(int fd, const struct iovec* iov, int iovcnt) {
+    int attempt = 0;
+    int wbytes;
+    while (attempt++ < 5) {
+        wbytes = writev(fd, iov, iovcnt);
+        if (wbytes < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        break;
+    }
+    return wbytes;
+}
+
 int __robust_SSL_write(SSL* ssl, void* buf, int buflen) {
     int attempt = 0;
     int wbytes;
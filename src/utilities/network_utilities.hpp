@@ -2,6 +2,7 @@
 
 #include <string>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 // openSSL
 #include <openssl/bio.h>
@@ -11,6 +12,9 @@
 /** Just a robust write() call */
 int __robust_write(int fd, uint8_t* buf, size_t buflen);
 
+/** Just a robust writev() call */
+int __robust_writev(int fd, const struct iovec* iov, int iovcnt);
+
 /** Just a robust SSL_write() call */
 int __robust_SSL_write(SSL* ssl, void* buf, int buflen);
 
@@ -4,4 +4,16 @@ milliseconds __get_time_ms() {
     return duration_cast< milliseconds >(
         system_clock::now().time_since_epoch()
     );
-}
\ No newline at end of file
+}
+
+milliseconds __get_monotonic_time_ms() {
+    return duration_cast< milliseconds >(
+        steady_clock::now().time_since_epoch()
+    );
+}
+
+microseconds __get_monotonic_time_us() {
+    return duration_cast< microseconds >(
+        steady_clock::now().time_since_epoch()
+    );
+}
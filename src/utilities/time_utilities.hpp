@@ -4,3 +4,9 @@
 using namespace std::chrono;
 
 milliseconds __get_time_ms();
+
+/** Time (ms) from a monotonic clock, to be used for deadlines */
+milliseconds __get_monotonic_time_ms();
+
+/** Time (us) from a monotonic clock, to be used for measuring durations */
+microseconds __get_monotonic_time_us();
@@ -0,0 +1,183 @@
+#include "utilities/timer_wheel.hpp"
+
+#include <algorithm>
+#include <climits>
+
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+TimerWheel::TimerWheel(milliseconds resolution, milliseconds now) : m_resolution(resolution), m_expiring(nullptr), m_num_timers(0) {
+    if (m_resolution.count() <= 0)
+        m_resolution = milliseconds(1);
+    m_current_tick = (uint64_t)now.count() / m_resolution.count();
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        m_occupied[level] = 0;
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            m_slots[level][slot] = nullptr;
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    Clear();
+}
+
+void TimerWheel::__insert(TIMER* timer) {
+    uint64_t expiry = std::max(timer->expiry_tick, m_current_tick);
+    uint64_t delta = expiry - m_current_tick;
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_SLOT_BITS * (level + 1))))
+        level++;
+    if (delta >= (1ull << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)))
+        expiry = m_current_tick + (1ull << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1; // cascaded again later
+    int slot = (int)((expiry >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK);
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = nullptr;
+    timer->next = m_slots[level][slot];
+    if (timer->next)
+        timer->next->prev = timer;
+    m_slots[level][slot] = timer;
+    m_occupied[level] |= 1ull << slot;
+}
+
+void TimerWheel::__unlink(TIMER* timer) {
+    TIMER** head = timer->level < 0 ? &m_expiring : &m_slots[timer->level][timer->slot];
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *head = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    if (timer->level >= 0 && !*head)
+        m_occupied[timer->level] &= ~(1ull << timer->slot);
+    timer->prev = timer->next = nullptr;
+}
+
+void TimerWheel::__cascade(int level, int slot) {
+    TIMER* timer = m_slots[level][slot];
+    m_slots[level][slot] = nullptr;
+    m_occupied[level] &= ~(1ull << slot);
+    while (timer) {
+        TIMER* next = timer->next;
+        __insert(timer);
+        timer = next;
+    }
+}
+
+uint64_t TimerWheel::__getNextEventTick() const {
+    uint64_t next_tick = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!m_occupied[level])
+            continue;
+
+        int shift = TIMER_WHEEL_SLOT_BITS * level;
+        int current_slot = (int)((m_current_tick >> shift) & TIMER_WHEEL_SLOT_MASK);
+        // slots of this level are processed when all the lower bits of the tick are 0
+        bool at_slot_start = (m_current_tick & ((1ull << shift) - 1)) == 0;
+        uint64_t round_start = (m_current_tick >> (shift + TIMER_WHEEL_SLOT_BITS)) << (shift + TIMER_WHEEL_SLOT_BITS);
+        uint64_t round_size = 1ull << (shift + TIMER_WHEEL_SLOT_BITS);
+
+        // first non-empty slot that is still ahead in this round, otherwise the first one of the next round
+        int first_ahead = at_slot_start ? current_slot : current_slot + 1;
+        uint64_t ahead = first_ahead < TIMER_WHEEL_SLOTS ? m_occupied[level] & (~0ull << first_ahead) : 0;
+        uint64_t tick;
+        if (ahead)
+            tick = round_start + ((uint64_t)__builtin_ctzll(ahead) << shift);
+        else
+            tick = round_start + round_size + ((uint64_t)__builtin_ctzll(m_occupied[level]) << shift);
+        next_tick = std::min(next_tick, tick);
+    }
+    return std::max(next_tick, m_current_tick);
+}
+
+void TimerWheel::__processTick() {
+    int slot = (int)(m_current_tick & TIMER_WHEEL_SLOT_MASK);
+    if (slot == 0) {
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            int level_slot = (int)((m_current_tick >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK);
+            __cascade(level, level_slot);
+            if (level_slot != 0)
+                break;
+        }
+    }
+
+    // detach the expiring timers so that callbacks scheduling/cancelling timers are safe
+    m_expiring = m_slots[0][slot];
+    m_slots[0][slot] = nullptr;
+    m_occupied[0] &= ~(1ull << slot);
+    for (TIMER* timer = m_expiring; timer; timer = timer->next)
+        timer->level = -1;
+    m_current_tick++;
+
+    while (m_expiring) {
+        TIMER* timer = m_expiring;
+        __unlink(timer);
+        m_num_timers--;
+        timer->callback();
+        delete timer;
+    }
+}
+
+TimerWheel::TIMER* TimerWheel::Schedule(milliseconds deadline, std::function<void()> callback) {
+    TIMER* timer = new TIMER;
+    // round up: a timer never fires before its deadline
+    timer->expiry_tick = ((uint64_t)std::max<milliseconds::rep>(0, deadline.count()) + m_resolution.count() - 1) / m_resolution.count();
+    timer->callback = std::move(callback);
+    __insert(timer);
+    m_num_timers++;
+    return timer;
+}
+
+void TimerWheel::Cancel(TIMER* timer) {
+    __unlink(timer);
+    m_num_timers--;
+    delete timer;
+}
+
+void TimerWheel::Advance(milliseconds now) {
+    uint64_t target_tick = (uint64_t)now.count() / m_resolution.count();
+    while (m_current_tick <= target_tick) {
+        uint64_t next_tick = m_num_timers > 0 ? __getNextEventTick() : UINT64_MAX;
+        if (next_tick > target_tick) {
+            m_current_tick = target_tick + 1;
+            break;
+        }
+        // skip the ticks with nothing to do
+        m_current_tick = next_tick;
+        __processTick();
+    }
+}
+
+int TimerWheel::GetTimeout(milliseconds now) const {
+    if (m_num_timers == 0)
+        return -1;
+    milliseconds::rep next_event = (milliseconds::rep)__getNextEventTick() * m_resolution.count();
+    milliseconds::rep remaining = next_event - now.count();
+    return (int)std::min<milliseconds::rep>(INT_MAX, std::max<milliseconds::rep>(0, remaining));
+}
+
+size_t TimerWheel::GetNumTimers() const {
+    return m_num_timers;
+}
+
+void TimerWheel::Clear() {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            TIMER* timer = m_slots[level][slot];
+            while (timer) {
+                TIMER* next = timer->next;
+                delete timer;
+                timer = next;
+            }
+            m_slots[level][slot] = nullptr;
+        }
+        m_occupied[level] = 0;
+    }
+    while (m_expiring) {
+        TIMER* next = m_expiring->next;
+        delete m_expiring;
+        m_expiring = next;
+    }
+    m_num_timers = 0;
+}
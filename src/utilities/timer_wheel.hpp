@@ -0,0 +1,142 @@
+#pragma once
+
+#include "utilities/time_utilities.hpp"
+
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+/** Number of levels of a TimerWheel */
+#define TIMER_WHEEL_LEVELS 4
+/** log2 of the number of slots in each level of a TimerWheel */
+#define TIMER_WHEEL_SLOT_BITS 6
+/** Number of slots in each level of a TimerWheel */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+/**
+ * Hierarchical timer wheel (NOT thread safe, meant to be owned by a single event loop).
+ *
+ * Time is divided in ticks of a fixed resolution. Level 0 has one slot per tick for the
+ * next TIMER_WHEEL_SLOTS ticks, and each level above has slots TIMER_WHEEL_SLOTS times
+ * wider. A timer is linked into the slot of the level matching how far its expiry is, and
+ * is moved one level down (cascaded) whenever the wheel reaches the start of its slot, so:
+ *     - Schedule() and Cancel() are O(1)
+ *     - Advance() only visits the slots that are non-empty (occupancy bitmaps are used to
+ *       skip the empty ones), never the ticks in between
+ *     - GetTimeout() gives the time until the next slot that needs processing, which is
+ *       meant to be used as the timeout of the event loop's poll
+ */
+class TimerWheel {
+public:
+    /**
+     * A scheduled timer. The pointer returned by Schedule() is a handle that can be passed to
+     * Cancel() until the timer's callback is called (it is freed right after).
+     */
+    struct TIMER {
+        /** neighbours in the slot list */
+        TIMER* prev;
+        TIMER* next;
+        /** tick at which the timer expires */
+        uint64_t expiry_tick;
+        /** level/slot the timer is linked in (level is -1 while the timer is expiring) */
+        int level;
+        int slot;
+        /** called when the timer expires */
+        std::function<void()> callback;
+    };
+
+private:
+    /** duration of a tick */
+    milliseconds m_resolution;
+    /** next tick to be processed */
+    uint64_t m_current_tick;
+    /** heads of the slot lists */
+    TIMER* m_slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    /** bitmap of the non-empty slots of each level */
+    uint64_t m_occupied[TIMER_WHEEL_LEVELS];
+    /** timers of the tick being processed whose callback was not called yet */
+    TIMER* m_expiring;
+    /** number of scheduled timers */
+    size_t m_num_timers;
+
+    /**
+     * Links a timer into the slot matching its expiry (relative to m_current_tick)
+     * @param timer  Timer to link
+     */
+    void __insert(TIMER* timer);
+
+    /**
+     * Unlinks a timer from its slot (or from m_expiring)
+     * @param timer  Timer to unlink
+     */
+    void __unlink(TIMER* timer);
+
+    /**
+     * Re-inserts the timers of a slot of a higher level into the lower levels
+     * @param level  Level of the slot
+     * @param slot   Index of the slot
+     */
+    void __cascade(int level, int slot);
+
+    /**
+     * @return the first tick (>= m_current_tick) at which a slot needs processing (only call
+     *         if there are timers scheduled)
+     */
+    uint64_t __getNextEventTick() const;
+
+    /**
+     * Processes m_current_tick: performs the cascades that are due and calls the callbacks
+     * of the timers expiring at that tick
+     */
+    void __processTick();
+
+public:
+    /**
+     * Creates an empty wheel
+     * @param resolution  Duration of a tick (timers never fire early, but may fire up to a tick late)
+     * @param now         Current (monotonic) time
+     */
+    TimerWheel(milliseconds resolution, milliseconds now);
+
+    /**
+     * Frees all the timers (without calling their callbacks)
+     */
+    ~TimerWheel();
+
+    /**
+     * Schedules a timer
+     * @param deadline  (monotonic) time at which the callback should be called (a deadline that
+     *                  already passed fires at the next tick)
+     * @param callback  Function to call, it may schedule and cancel timers
+     * @return handle of the timer
+     */
+    TIMER* Schedule(milliseconds deadline, std::function<void()> callback);
+
+    /**
+     * Cancels a timer whose callback was not called yet
+     * @param timer  Handle returned by Schedule()
+     */
+    void Cancel(TIMER* timer);
+
+    /**
+     * Calls the callbacks of all the timers that expired
+     * @param now  Current (monotonic) time
+     */
+    void Advance(milliseconds now);
+
+    /**
+     * @param now  Current (monotonic) time
+     * @return time (ms) until Advance() has something to do, -1 if there are no timers
+     */
+    int GetTimeout(milliseconds now) const;
+
+    /**
+     * @return number of scheduled timers
+     */
+    size_t GetNumTimers() const;
+
+    /**
+     * Frees all the timers (without calling their callbacks)
+     */
+    void Clear();
+};
@@ -68,6 +68,8 @@ struct SENT_HTTP_REQUEST {
 
 std::vector<SENT_HTTP_REQUEST*> g_pending_http_requests;
 std::vector<std::function<void()>> g_pending_http_connects;
+/** protects g_pending_http_connects (rooms are registered from the socket cluster reactors) */
+std::mutex g_pending_http_connects_mutex;
 
 SENT_HTTP_REQUEST* get_sent_http_request(struct lws* client) {
     for (size_t i = 0; i < g_pending_http_requests.size(); i++) {
@@ -322,9 +324,13 @@ int http_callback_broker(struct lws *wsi, enum lws_callback_reasons reason, void
 }
 
 void VerbozeAPI::__updateHTTP() {
-    for (size_t i = 0; i < g_pending_http_connects.size(); i++)
-        g_pending_http_connects[i]();
-    g_pending_http_connects.clear();
+    std::vector<std::function<void()>> connects;
+    g_pending_http_connects_mutex.lock();
+    connects.swap(g_pending_http_connects);
+    g_pending_http_connects_mutex.unlock();
+
+    for (size_t i = 0; i < connects.size(); i++)
+        connects[i]();
 }
 
 void VerbozeAPI::Endpoints::DefaultResponseHandler(VerbozeHttpResponse response) {
@@ -353,6 +359,7 @@ void VerbozeAPI::Endpoints::RegisterRoom(
 
 
     std::string token = m_connection_token;
+    g_pending_http_connects_mutex.lock();
     g_pending_http_connects.push_back(
         [token, room_id, room_name, interface, ip, port, type, data, callback]() {
             connect_http_client(token, "POST", make_request_url("api/rooms/"), {}, {
@@ -366,5 +373,6 @@ void VerbozeAPI::Endpoints::RegisterRoom(
                 }, callback);
         }
     );
+    g_pending_http_connects_mutex.unlock();
     lws_cancel_service(GetLWSContext());
 }
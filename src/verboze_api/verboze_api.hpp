@@ -14,7 +14,7 @@
 #include <json.hpp>
 using json = nlohmann::json;
 
-typedef void (*CommandCallback) (json);
+typedef void (*CommandCallback) (json&&);
 typedef std::function<void(class VerbozeHttpResponse)> HttpResponseCallback;
 
 #define WEBSOCKET_HEARTBEAT_INTERVAL 10000
@@ -93,8 +93,15 @@ public:
 
     /**
      * Send a command over websockets
+     * @param command Command to send (only serialized, never copied)
      */
-    static void SendCommand(json command);
+    static void SendCommand(const json& command);
+
+    /**
+     * Send an already serialized command over websockets
+     * @param command Serialized JSON command (moved into the send queue)
+     */
+    static void SendSerializedCommand(std::string&& command);
 
     /**
      * Sets the callback to be called when a command is received over websockets from Verboze
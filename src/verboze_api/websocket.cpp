@@ -146,7 +146,7 @@ int websocket_callback_broker(struct lws* wsi, enum lws_callback_reasons reason,
         if (!jmsg.is_null()) {
             LOG(trace) << "Got command from websocket: " << jmsg;
             if (ws_global::g_command_callback)
-                ws_global::g_command_callback(jmsg);
+                ws_global::g_command_callback(std::move(jmsg));
         } else
             LOG(error) << "Got invalid JSON from websocket: " << smsg;
 
@@ -194,10 +194,21 @@ int websocket_callback_broker(struct lws* wsi, enum lws_callback_reasons reason,
 	return lws_callback_http_dummy(wsi, reason, user, in, len);
 }
 
-void VerbozeAPI::SendCommand(json command) {
+void VerbozeAPI::SendCommand(const json& command) {
+    std::string serialized;
+    try {
+        serialized = command.dump();
+    } catch (...) {
+        LOG(fatal) << "Failed to serialize websocket message";
+        return;
+    }
+    SendSerializedCommand(std::move(serialized));
+}
+
+void VerbozeAPI::SendSerializedCommand(std::string&& command) {
     ws_global::g_connection_mutex.lock();
     try {
-        ws_global::g_message_queue.push(command.dump());
+        ws_global::g_message_queue.push(std::move(command));
         if (ws_global::g_is_connected)
 			lws_callback_on_writable(ws_global::g_client_wsi);
     } catch (...) {
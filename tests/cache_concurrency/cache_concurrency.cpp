@@ -0,0 +1,154 @@
+#include "logging/logging.hpp"
+#include "aggregator_clients/aggregator_client.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/**
+ * Stress test of the room cache: a writer merges state updates (as the reactor thread does)
+ * while readers query the cache (as the Verboze thread does). Every update sets the "seq"
+ * property of all the things at once, so a consistent view has the same seq everywhere, and
+ * the seq and version seen by a reader never go back.
+ * Usage: ./cache_concurrency [blueprint.json] [updates] [readers]
+ */
+
+/**
+ * A room that is not connected to anything
+ */
+class TestRoom : public AggregatorClient {
+public:
+    TestRoom(DISCOVERED_DEVICE device) : AggregatorClient(-1, device) {}
+};
+
+/** set by the first reader that sees an inconsistent view */
+static std::atomic<bool> g_is_failed(false);
+
+static void __fail(const std::string& reason, const std::string& serialized) {
+    if (!g_is_failed.exchange(true))
+        std::cerr << reason << ": " << serialized << std::endl;
+}
+
+/**
+ * @param object    Object of things
+ * @param seq       Set to the seq of the things
+ * @return whether all the things have the same seq
+ */
+static bool __get_seq(const json& object, int64_t* seq) {
+    *seq = -1;
+    for (auto it = object.begin(); it != object.end(); it++) {
+        if (!it->is_object() || it->find("seq") == it->end())
+            continue;
+        int64_t thing_seq = (*it)["seq"];
+        if (*seq >= 0 && thing_seq != *seq)
+            return false;
+        *seq = thing_seq;
+    }
+    return true;
+}
+
+static void __reader(const TestRoom* room, const std::string& room_id, const std::string& thing_id,
+                     const std::atomic<bool>* is_writing, size_t* num_reads) {
+    int64_t last_seq = -1;
+    uint64_t last_version = 0;
+    while (*is_writing && !g_is_failed) {
+        // whole blueprint
+        std::string serialized = room->GetSerializedCache(",\"__room_id\":\"" + room_id + "\"");
+        json blueprint = json::parse(serialized);
+        int64_t seq;
+        if (!__get_seq(blueprint, &seq))
+            return __fail("Blueprint mixes two versions", serialized);
+        uint64_t version = blueprint["__version"];
+        if (seq < last_seq || version < last_version)
+            return __fail("Blueprint went back in time", serialized);
+        last_seq = seq;
+        last_version = version;
+
+        // single thing
+        serialized = room->GetSerializedCache("", thing_id);
+        json thing = json::parse(serialized);
+        if (thing.find("seq") != thing.end()) {
+            if (thing["seq"].get<int64_t>() < last_seq || thing["__version"].get<uint64_t>() < last_version)
+                return __fail("Thing went back in time", serialized);
+            last_seq = thing["seq"];
+            last_version = thing["__version"];
+        }
+
+        // changes since the last version seen
+        serialized = room->GetSerializedChanges("", last_version);
+        json changes = json::parse(serialized);
+        if (!__get_seq(changes, &seq) || (seq >= 0 && seq <= last_seq) || changes["__version"].get<uint64_t>() < last_version)
+            return __fail("Changes are inconsistent", serialized);
+
+        if (room->GetID() != room_id)
+            return __fail("Wrong room id", room->GetID());
+
+        *num_reads += 3;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string blueprint_path = argc > 1 ? argv[1] : "../codec_benchmark/blueprint.json";
+    int num_updates = argc > 2 ? std::stoi(argv[2]) : 20000;
+    int num_readers = argc > 3 ? std::stoi(argv[3]) : 3;
+
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    std::ifstream blueprint_file(blueprint_path);
+    if (!blueprint_file.is_open()) {
+        std::cerr << "Failed to open " << blueprint_path << std::endl;
+        return 1;
+    }
+    json blueprint = json::parse(blueprint_file);
+    std::string room_id = blueprint["config"]["id"];
+    std::vector<std::string> things;
+    for (auto it = blueprint.begin(); it != blueprint.end(); it++)
+        if (it.key() != "config")
+            things.push_back(it.key());
+
+    DISCOVERED_DEVICE device;
+    device.name = "test-room";
+    device.ip = "127.0.0.1";
+    device.port = 0;
+    device.type = 3;
+    std::shared_ptr<TestRoom> room = std::make_shared<TestRoom>(device);
+    room->OnMessage(json(blueprint));
+
+    std::atomic<bool> is_writing(true);
+    std::vector<size_t> num_reads(num_readers, 0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < num_readers; r++)
+        readers.emplace_back(__reader, room.get(), room_id, things[r % things.size()], &is_writing, &num_reads[r]);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int seq = 0; seq < num_updates && !g_is_failed; seq++) {
+        json update = json::object();
+        for (auto it = things.begin(); it != things.end(); it++)
+            update[*it]["seq"] = seq;
+        room->OnMessage(std::move(update));
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    is_writing = false;
+    for (auto it = readers.begin(); it != readers.end(); it++)
+        it->join();
+
+    size_t total_reads = 0;
+    for (auto it = num_reads.begin(); it != num_reads.end(); it++)
+        total_reads += *it;
+    std::cout << num_updates << " updates of " << things.size() << " things in " << elapsed.count() << " ms, "
+              << total_reads << " concurrent reads by " << num_readers << " readers" << std::endl;
+
+    if (g_is_failed)
+        return 1;
+    if (total_reads == 0) {
+        std::cerr << "The readers did not run" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "utilities/message_codec.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+/**
+ * Compares the size and the encoding/decoding cost of the messages exchanged with the
+ * middlewares in every codec.
+ * Usage: ./codec_benchmark [blueprint.json] [iterations]
+ */
+
+struct SAMPLE {
+    std::string name;
+    json msg;
+};
+
+static double __nanoseconds_per_op(std::chrono::steady_clock::time_point start, int iterations) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+}
+
+int main(int argc, char** argv) {
+    std::string blueprint_path = argc > 1 ? argv[1] : "blueprint.json";
+    int iterations = argc > 2 ? std::stoi(argv[2]) : 20000;
+
+    std::ifstream blueprint_file(blueprint_path);
+    if (!blueprint_file.is_open()) {
+        std::cerr << "Failed to open " << blueprint_path << std::endl;
+        return 1;
+    }
+
+    std::vector<SAMPLE> samples;
+    samples.push_back({"blueprint", json::parse(blueprint_file)});
+    samples.push_back({"state update", {{"light-3", {{"intensity", 67}}}}});
+    samples.push_back({"control command", {{"code", 0}}});
+    samples.push_back({"heartbeat", json::object()});
+
+    std::cout << std::left << std::setw(18) << "message" << std::setw(10) << "codec"
+              << std::right << std::setw(10) << "bytes" << std::setw(14) << "encode ns" << std::setw(14) << "decode ns" << std::endl;
+
+    size_t checksum = 0;
+    for (auto& sample : samples) {
+        for (int c = 0; c < NUM_MESSAGE_CODECS; c++) {
+            MESSAGE_CODEC codec = (MESSAGE_CODEC)c;
+            std::string encoded = __encode_message(sample.msg, codec);
+
+            json decoded;
+            if (__decode_message((const uint8_t*)encoded.data(), encoded.size(), decoded) != 0 || decoded != sample.msg) {
+                std::cerr << "Round trip of " << sample.name << " failed with " << __codec_name(codec) << std::endl;
+                return 1;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++)
+                checksum += __encode_message(sample.msg, codec).size();
+            double encode_ns = __nanoseconds_per_op(start, iterations);
+
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                __decode_message((const uint8_t*)encoded.data(), encoded.size(), decoded);
+                checksum += decoded.size();
+            }
+            double decode_ns = __nanoseconds_per_op(start, iterations);
+
+            std::cout << std::left << std::setw(18) << sample.name << std::setw(10) << __codec_name(codec)
+                      << std::right << std::setw(10) << encoded.size()
+                      << std::fixed << std::setprecision(0) << std::setw(14) << encode_ns << std::setw(14) << decode_ns << std::endl;
+        }
+    }
+
+    // keeps the loops from being optimized away
+    return checksum == 0 ? 1 : 0;
+}
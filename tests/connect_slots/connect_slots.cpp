@@ -0,0 +1,219 @@
+#include "config/config.hpp"
+#include "socket_cluster/socket_cluster.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Checks that a client deregistered while it connects (or does its SSL handshake) gives its
+ * connect slot back right away: with a single slot, the next client must connect long before
+ * the connect/handshake timeouts.
+ * The client is deregistered the way an unreachable middleware is, by writing past the hard
+ * watermark while it connects.
+ * Usage: ./connect_slots [event-backend] [ssl-key ssl-cert]
+ * (the handshake case only runs with an SSL key and certificate)
+ */
+
+/** connect and handshake timeouts (ms), a slot given back by a timeout comes far too late */
+#define SLOT_TIMEOUT 30000
+/** time (ms) allowed for the next client to connect and receive its first message */
+#define CONNECT_DEADLINE 3000
+/** output (bytes) above which a client is disconnected */
+#define HARD_WATERMARK 4096
+/** time (ms) given to the reactor to start the connect (or handshake) of the first client */
+#define START_DELAY 300
+
+/**
+ * A client counting the messages it receives
+ */
+class TestClient : public SocketClient {
+public:
+    std::atomic<int> num_messages;
+
+    TestClient(int fd, DISCOVERED_DEVICE device) : SocketClient(fd, device), num_messages(0) {}
+
+    bool OnMessage(json&& msg) override {
+        num_messages++;
+        return true;
+    }
+};
+
+/** accepted connections of the listeners, closed at the end */
+static std::vector<int> g_accepted_fds;
+static std::mutex g_accepted_fds_mutex;
+
+/**
+ * @param backlog  Backlog of the listening socket
+ * @param port     Set to the port of the listening socket
+ * @return the listening socket on 127.0.0.1, negative value on failure
+ */
+static int __listen(int backlog, int* port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_size = sizeof(addr);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, backlog) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_size) != 0)
+        return -1;
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/**
+ * Accepts connections forever, sending them a message if is_hello (they stay silent otherwise)
+ */
+static void __serve(int listen_fd, bool is_hello) {
+    std::string payload = "{\"hello\":1}";
+    uint32_t payload_size = (uint32_t)payload.size();
+    std::string frame((const char*)&payload_size, sizeof(payload_size));
+    frame += payload;
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            return;
+        if (is_hello && write(fd, frame.data(), frame.size()) != (ssize_t)frame.size())
+            std::cerr << "Failed to send the hello message" << std::endl;
+        g_accepted_fds_mutex.lock();
+        g_accepted_fds.push_back(fd);
+        g_accepted_fds_mutex.unlock();
+    }
+}
+
+/**
+ * @return a listening socket that never completes new connections (its backlog is full), negative value on failure
+ */
+static int __listenStalled(int* port) {
+    int listen_fd = __listen(0, port);
+    if (listen_fd < 0)
+        return -1;
+    // the one connection the backlog allows, later SYNs are dropped until the connect() times out
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(*port);
+    connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    if (poll(&pfd, 1, 1000) != 1)
+        return -1;
+    g_accepted_fds.push_back(fd);
+    return listen_fd;
+}
+
+/**
+ * Deregisters a client through the hard watermark while it connects, then connects another one
+ * @return whether the other client connected before CONNECT_DEADLINE
+ */
+static bool __checkSlotIsReleased(const std::string& name, DISCOVERED_DEVICE blocked_device, DISCOVERED_DEVICE device) {
+    SocketClientPtr blocked = SocketClient::Create<TestClient>(blocked_device);
+    if (!blocked) {
+        std::cerr << "Failed to create the blocked client" << std::endl;
+        return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(START_DELAY));
+    blocked->Write({{"data", std::string(HARD_WATERMARK, 'x')}});
+
+    std::shared_ptr<TestClient> client = std::static_pointer_cast<TestClient>(SocketClient::Create<TestClient>(device));
+    if (!client) {
+        std::cerr << "Failed to create the client" << std::endl;
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (client->num_messages == 0 && std::chrono::steady_clock::now() - start < std::chrono::milliseconds(CONNECT_DEADLINE))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    bool is_released = client->num_messages > 0;
+    std::cout << name << ": " << (is_released ? "next client connected in " + std::to_string(elapsed) + " ms" : "connect slot not released") << std::endl;
+    SocketCluster::DeregisterClient(client);
+    return is_released;
+}
+
+int main(int argc, char** argv) {
+    std::string backend = argc > 1 ? argv[1] : "io_uring";
+    bool is_handshake_tested = argc > 3;
+
+    std::vector<std::string> args = {
+        argv[0], "--event-backend", backend, "--reactor-threads", "1", "--max-pending-connects", "1",
+        "--connect-timeout", std::to_string(SLOT_TIMEOUT), "--handshake-timeout", std::to_string(SLOT_TIMEOUT),
+        "--output-soft-watermark", "1024", "--output-hard-watermark", std::to_string(HARD_WATERMARK), "-v", "2",
+    };
+    if (is_handshake_tested) {
+        args.push_back("--ssl-key");
+        args.push_back(argv[2]);
+        args.push_back("--ssl-cert");
+        args.push_back(argv[3]);
+    }
+    std::vector<char*> cargs;
+    for (auto it = args.begin(); it != args.end(); it++)
+        cargs.push_back(&(*it)[0]);
+    if (ConfigManager::LoadFromCommandline((int)cargs.size(), cargs.data()) != 0 || SocketCluster::Initialize() != 0) {
+        std::cerr << "Failed to initialize the socket cluster" << std::endl;
+        return 1;
+    }
+
+    int hello_port, silent_port, stalled_port;
+    int hello_fd = __listen(16, &hello_port);
+    int silent_fd = __listen(16, &silent_port);
+    int stalled_fd = __listenStalled(&stalled_port);
+    if (hello_fd < 0 || silent_fd < 0 || stalled_fd < 0) {
+        std::cerr << "Failed to listen" << std::endl;
+        return 1;
+    }
+    std::thread(__serve, hello_fd, true).detach();
+    std::thread(__serve, silent_fd, false).detach();
+
+    DISCOVERED_DEVICE device;
+    device.name = "hello";
+    device.ip = "127.0.0.1";
+    device.port = hello_port;
+    device.type = 3;
+
+    bool is_released = true;
+
+    DISCOVERED_DEVICE stalled_device = device;
+    stalled_device.name = "stalled";
+    stalled_device.port = stalled_port;
+    is_released &= __checkSlotIsReleased("connect", stalled_device, device);
+
+    if (is_handshake_tested) {
+        DISCOVERED_DEVICE silent_device = device;
+        silent_device.name = "silent";
+        silent_device.port = silent_port;
+        silent_device.type = 8; // SSL
+        is_released &= __checkSlotIsReleased("handshake", silent_device, device);
+    }
+
+    SocketCluster::Cleanup();
+    // wakes up the accept() of the listeners
+    shutdown(hello_fd, SHUT_RDWR);
+    shutdown(silent_fd, SHUT_RDWR);
+    close(stalled_fd);
+    g_accepted_fds_mutex.lock();
+    for (auto it = g_accepted_fds.begin(); it != g_accepted_fds.end(); it++)
+        close(*it);
+    g_accepted_fds_mutex.unlock();
+
+    if (!is_released) {
+        std::cerr << "Deregistered clients keep their connect slot" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include "logging/logging.hpp"
+#include "aggregator_clients/aggregator_client.hpp"
+#include "utilities/message_codec.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <vector>
+
+/**
+ * Counts the allocations made for every message going through the middleware -> Verboze path
+ * (AggregatorClient::OnMessage() caching it and forwarding the delta with VerbozeAPI::SendCommand())
+ * and the Verboze -> middleware path (AggregatorClient::Write() queueing it), and checks them
+ * against a fixed budget per message. Going over the budget means a copy of the message was
+ * added between the hops (the slack of a budget is smaller than one copy).
+ * Usage: ./message_copies [blueprint.json] [messages]
+ */
+
+/**
+ * Allocations for a state update of one thing ({"light-N": {"intensity": V, "on": B}}):
+ *  13  decoding it
+ *   5  merging it into the StateStore and building the delta (4.5 on average)
+ *  20  publishing the cache (snapshot, things vector, thing, its dumped state and key)
+ *   3  stamping __room_id and __version on the delta
+ *   5  serializing the delta (queued by moving it to the websocket)
+ *   4  destroying the message and the delta (3.5 on average)
+ */
+#define MIDDLEWARE_TO_VERBOZE_BUDGET 50
+
+/**
+ * Allocations for a state command ({"thing": "light-N", "intensity": V}):
+ *   4  encoding it (the thing name fits in the small string buffer)
+ *   1  the outbox node
+ */
+#define VERBOZE_TO_MIDDLEWARE_BUDGET 5
+
+/** number of calls to operator new */
+static std::atomic<size_t> g_allocations(0);
+
+// not inlined, so the compiler does not pair a replaced new with a free() it cannot see
+__attribute__((noinline)) static void* __allocate(size_t size) {
+    void* ptr = malloc(size > 0 ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    g_allocations++;
+    return ptr;
+}
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    return __allocate(size);
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) {
+    return __allocate(size);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+#ifdef __cpp_aligned_new
+__attribute__((noinline)) static void* __allocate_aligned(size_t size, std::align_val_t alignment) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, std::max((size_t)alignment, sizeof(void*)), size > 0 ? size : 1) != 0)
+        throw std::bad_alloc();
+    g_allocations++;
+    return ptr;
+}
+
+__attribute__((noinline)) void* operator new(size_t size, std::align_val_t alignment) {
+    return __allocate_aligned(size, alignment);
+}
+
+__attribute__((noinline)) void* operator new[](size_t size, std::align_val_t alignment) {
+    return __allocate_aligned(size, alignment);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+#endif
+
+/**
+ * A room that is not connected to anything (writes stay in its outbox)
+ */
+class TestRoom : public AggregatorClient {
+public:
+    TestRoom(DISCOVERED_DEVICE device) : AggregatorClient(-1, device) {}
+};
+
+/**
+ * Prints a row of the results
+ * @return whether the path stayed within its budget
+ */
+static bool __report(const std::string& path, size_t allocations, size_t budget, size_t num_messages) {
+    double per_message = (double)allocations / num_messages;
+    std::cout << std::left << std::setw(26) << path << std::right << std::fixed << std::setprecision(2)
+              << std::setw(14) << per_message << std::setw(14) << budget << std::endl;
+    return per_message <= budget;
+}
+
+int main(int argc, char** argv) {
+    std::string blueprint_path = argc > 1 ? argv[1] : "../codec_benchmark/blueprint.json";
+    size_t num_messages = argc > 2 ? (size_t)std::stoul(argv[2]) : 100000;
+
+    // trace logging would allocate for every message
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    std::ifstream blueprint_file(blueprint_path);
+    if (!blueprint_file.is_open()) {
+        std::cerr << "Failed to open " << blueprint_path << std::endl;
+        return 1;
+    }
+    std::string blueprint = json::parse(blueprint_file).dump();
+
+    // state updates as sent by the middlewares, and state commands as sent by Verboze
+    std::vector<std::string> updates;
+    std::vector<json> commands;
+    json parsed_blueprint = json::parse(blueprint);
+    for (auto it = parsed_blueprint.begin(); it != parsed_blueprint.end(); it++) {
+        if (it->find("intensity") != it->end()) {
+            for (int value = 0; value < 4; value++) {
+                updates.push_back(json({{it.key(), {{"intensity", value * 25}, {"on", value > 0}}}}).dump());
+                commands.push_back({{"thing", it.key()}, {"intensity", value * 25}});
+            }
+        }
+    }
+
+    DISCOVERED_DEVICE device;
+    device.name = "test-room";
+    device.ip = "127.0.0.1";
+    device.port = 0;
+    device.type = 3;
+    std::shared_ptr<TestRoom> room = std::make_shared<TestRoom>(device);
+    room->OnMessage(json::parse(blueprint));
+
+    std::cout << std::left << std::setw(26) << "path" << std::right << std::setw(14) << "allocs/msg"
+              << std::setw(14) << "budget" << std::endl;
+    bool is_within_budget = true;
+
+    /** middleware -> Verboze */
+    size_t start = g_allocations;
+    for (size_t i = 0; i < num_messages; i++)
+        room->OnMessage(json::parse(updates[i % updates.size()]));
+    is_within_budget &= __report("middleware -> Verboze", g_allocations - start, MIDDLEWARE_TO_VERBOZE_BUDGET, num_messages);
+
+    /** Verboze -> middleware (few enough writes to stay below the soft watermark) */
+    size_t num_writes = std::min(num_messages, (size_t)500);
+    start = g_allocations;
+    for (size_t i = 0; i < num_writes; i++)
+        room->Write(commands[i % commands.size()]);
+    is_within_budget &= __report("Verboze -> middleware", g_allocations - start, VERBOZE_TO_MIDDLEWARE_BUDGET, num_writes);
+
+    if (!is_within_budget) {
+        std::cerr << "Messages are copied along the way" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+#include "aggregator_clients/state_store.hpp"
+
+#include <malloc.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <vector>
+
+/**
+ * Compares the memory used by the room caches and the cost of merging state updates into
+ * them, between the JSON DOM the AggregatorClient used to keep and the StateStore.
+ * Usage: ./state_store_benchmark [blueprint.json] [rooms] [updates]
+ */
+
+/** bytes currently allocated through operator new (as reported by the allocator) */
+static std::atomic<size_t> g_allocated_bytes(0);
+
+void* operator new(size_t size) {
+    void* ptr = malloc(size);
+    if (!ptr)
+        throw std::bad_alloc();
+    g_allocated_bytes += malloc_usable_size(ptr);
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr)
+        g_allocated_bytes -= malloc_usable_size(ptr);
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+/**
+ * The merge of the JSON DOM cache as it was done by AggregatorClient::OnMessage() (the message
+ * is passed by value, and every key and value is copied while walking it)
+ */
+static bool __legacy_merge_json(json* base, json new_data) {
+    bool is_changed = false;
+    if (new_data.is_object()) {
+        for (json::iterator it = new_data.begin(); it != new_data.end(); it++) {
+            std::string key = it.key();
+            json val = it.value();
+
+            auto existing_entry = base->find(key);
+            bool replace_entry = false;
+            if (existing_entry != base->end()) {
+                json* sub_base = &existing_entry.value();
+                if (sub_base->is_object() && val.is_object())
+                    is_changed = is_changed || __legacy_merge_json(sub_base, val);
+                else
+                    replace_entry = true;
+            } else
+                replace_entry = true;
+
+            if (replace_entry) {
+                (*base)[key] = val;
+                is_changed = true;
+            }
+        }
+    }
+    return is_changed;
+}
+
+static double __nanoseconds_per_op(std::chrono::steady_clock::time_point start, size_t iterations) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+}
+
+/**
+ * @param blueprint  Blueprint of the reference room
+ * @param room       Index of the room
+ * @return the blueprint of a room (same things as the reference room, different id and states)
+ */
+static json __make_room(const json& blueprint, int room) {
+    json copy = blueprint;
+    copy["config"]["id"] = "R-" + std::to_string(100000 + room);
+    int i = room;
+    for (auto it = copy.begin(); it != copy.end(); it++) {
+        if (it->find("intensity") != it->end())
+            (*it)["intensity"] = (i * 7) % 101;
+        i++;
+    }
+    return copy;
+}
+
+int main(int argc, char** argv) {
+    std::string blueprint_path = argc > 1 ? argv[1] : "../codec_benchmark/blueprint.json";
+    int num_rooms = argc > 2 ? std::stoi(argv[2]) : 300;
+    size_t num_updates = argc > 3 ? (size_t)std::stoul(argv[3]) : 1000000;
+
+    std::ifstream blueprint_file(blueprint_path);
+    if (!blueprint_file.is_open()) {
+        std::cerr << "Failed to open " << blueprint_path << std::endl;
+        return 1;
+    }
+    json blueprint = json::parse(blueprint_file);
+
+    std::vector<json> blueprints;
+    for (int r = 0; r < num_rooms; r++)
+        blueprints.push_back(__make_room(blueprint, r));
+
+    // state updates as sent by the middlewares (a property of a thing)
+    std::vector<std::string> things;
+    for (auto it = blueprint.begin(); it != blueprint.end(); it++)
+        if (it->find("intensity") != it->end())
+            things.push_back(it.key());
+    std::vector<json> updates;
+    for (size_t i = 0; i < 4096; i++)
+        updates.push_back({{things[(i * 13) % things.size()], {{"intensity", (int)((i * 31) % 101)}}}});
+
+    /** memory */
+    size_t before = g_allocated_bytes;
+    std::vector<json> dom_caches(num_rooms);
+    for (int r = 0; r < num_rooms; r++)
+        __legacy_merge_json(&dom_caches[r], blueprints[r]);
+    size_t dom_bytes = g_allocated_bytes - before;
+
+    before = g_allocated_bytes;
+    std::vector<StateStore> stores(num_rooms);
+    for (int r = 0; r < num_rooms; r++)
+        stores[r].Merge(blueprints[r]);
+    size_t store_bytes = g_allocated_bytes - before; // includes the names interned by the first room
+
+    for (int r = 0; r < num_rooms; r++) {
+        if (stores[r].ToJson() != dom_caches[r]) {
+            std::cerr << "StateStore of room " << r << " differs from the JSON DOM" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << num_rooms << " rooms of " << blueprint.size() << " things" << std::endl;
+    std::cout << std::left << std::setw(14) << "cache" << std::right << std::setw(14) << "bytes" << std::setw(16) << "bytes/room"
+              << std::setw(14) << "merge ns" << std::setw(14) << "export ns" << std::endl;
+
+    /** merge throughput (updates spread over all the rooms) */
+    size_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_updates; i++)
+        checksum += __legacy_merge_json(&dom_caches[i % num_rooms], updates[i % updates.size()]);
+    double dom_merge_ns = __nanoseconds_per_op(start, num_updates);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_updates; i++)
+        checksum += stores[i % num_rooms].Merge(updates[i % updates.size()]);
+    double store_merge_ns = __nanoseconds_per_op(start, num_updates);
+
+    /** export of a whole blueprint (GetCache()) */
+    size_t num_exports = std::max((size_t)1, num_updates / 100);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_exports; i++) {
+        json copy = dom_caches[i % num_rooms];
+        checksum += copy.size();
+    }
+    double dom_export_ns = __nanoseconds_per_op(start, num_exports);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_exports; i++)
+        checksum += stores[i % num_rooms].ToJson().size();
+    double store_export_ns = __nanoseconds_per_op(start, num_exports);
+
+    for (int r = 0; r < num_rooms; r++) {
+        if (stores[r].ToJson() != dom_caches[r]) {
+            std::cerr << "StateStore of room " << r << " differs from the JSON DOM after the updates" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << std::left << std::setw(14) << "json DOM" << std::right << std::setw(14) << dom_bytes << std::setw(16) << dom_bytes / num_rooms
+              << std::setw(14) << dom_merge_ns << std::setw(14) << dom_export_ns << std::endl;
+    std::cout << std::left << std::setw(14) << "StateStore" << std::right << std::setw(14) << store_bytes << std::setw(16) << store_bytes / num_rooms
+              << std::setw(14) << store_merge_ns << std::setw(14) << store_export_ns << std::endl;
+
+    // keeps the loops from being optimized away
+    return checksum == 0 ? 1 : 0;
+}